@@ -0,0 +1,9 @@
+#include "TCanny.h"
+
+//////////////////////////////////////////
+// Init
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    configFunc("com.holywu.tcanny", "tcanny", "Build an edge map using canny edge detection", VAPOURSYNTH_API_VERSION, 1, plugin);
+    registerFunc("TCanny", "clip:clip;sigma:float:opt;t_h:float:opt;t_l:float:opt;nms:int:opt;mode:int[]:opt;op:int:opt;gmmax:float:opt;planes:int[]:opt;opt:int:opt;fixed:int:opt;blur:int:opt;threads:int:opt;debug:int:opt;cache:int:opt;mask8:int:opt;roi:int[]:opt;mask:clip:opt;scale:int:opt;stats:int:opt;", tcannyCreate, nullptr, plugin);
+}
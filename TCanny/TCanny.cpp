@@ -20,32 +20,21 @@
 **   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#include <algorithm>
 #include <cfloat>
 #include <cmath>
-#include <vapoursynth/VapourSynth.h>
-#include <vapoursynth/VSHelper.h>
-
-#define M_PIF 3.14159265358979323846f
-
-struct TCannyData {
-    VSNodeRef * node;
-    const VSVideoInfo * vi;
-    float sigma, t_h, t_l, gmmax;
-    int nms, mode, op;
-    bool process[3];
-    int grad, bins;
-    float * weights;
-    float magnitude;
-    int peak;
-    float lower[3], upper[3];
-};
-
-struct Stack {
-    uint8_t * map;
-    std::pair<int, int> * pos;
-    int index;
-};
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include "TCanny.h"
 
 static void push(Stack & s, const int x, const int y) {
     s.pos[++s.index].first = x;
@@ -56,6 +45,61 @@ static std::pair<int, int> pop(Stack & s) {
     return s.pos[s.index--];
 }
 
+static void cpuid(int info[4], const int leaf, const int subleaf) {
+#ifdef _MSC_VER
+    __cpuidex(info, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+static uint64_t xgetbv(const unsigned index) {
+#ifdef _MSC_VER
+    return _xgetbv(index);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+// Returns the highest usable opt level: 1 = c, 2 = sse2, 3 = avx2 + fma + f16c, 4 = avx512 (f/bw/dq/vl)
+int detectOpt() {
+    int info[4];
+    cpuid(info, 0, 0);
+    const int maxLeaf = info[0];
+    cpuid(info, 1, 0);
+    if (!(info[3] & (1 << 26)))
+        return 1;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool f16c = (info[2] & (1 << 29)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || maxLeaf < 7)
+        return 2;
+    const uint64_t xcr0 = xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6)
+        return 2;
+    cpuid(info, 7, 0);
+    const bool avx2 = (info[1] & (1 << 5)) != 0;
+    const bool avx512 = (info[1] & (1 << 16)) && (info[1] & (1 << 17)) && (info[1] & (1 << 30)) && (info[1] & (1u << 31));
+    if (!avx2 || !fma || !f16c)
+        return 2;
+    if (avx512 && (xcr0 & 0xE6) == 0xE6)
+        return 4;
+    return 3;
+}
+
+// Runs task(0) .. task(count - 1) on the internal pool, or in order on the calling thread when there is none
+static void parallelFor(const TCannyData * d, const int count, const std::function<void(int)> & task) {
+    if (d->pool && count > 1) {
+        d->pool->run(count, task);
+    } else {
+        for (int i = 0; i < count; i++)
+            task(i);
+    }
+}
+
 static float * gaussianWeights(const float sigma, int & rad) {
     const int dia = std::max(static_cast<int>(sigma * 3.f + 0.5f), 1) * 2 + 1;
     rad = dia >> 1;
@@ -73,39 +117,59 @@ static float * gaussianWeights(const float sigma, int & rad) {
     return weights;
 }
 
+// Taps of the derivative of the gaussian, scaled so that a ramp of one per pixel gives 2 like op 0
+static float * derivativeWeights(const float * weights, const int rad) {
+    const int dia = rad * 2 + 1;
+    float * derivative = vs_aligned_malloc<float>(dia * sizeof(float), 32);
+    if (!derivative)
+        return nullptr;
+    float moment = 0.f;
+    for (int k = -rad; k <= rad; k++)
+        moment += k * k * weights[k + rad];
+    for (int k = -rad; k <= rad; k++)
+        derivative[k + rad] = 2.f * k * weights[k + rad] / moment;
+    return derivative;
+}
+
+// Q14 copy of the gaussian weights, rounded so that they add up to exactly 1 << fixedWeightBits
+static int16_t * fixedWeights(const float * weights, const int rad) {
+    const int dia = rad * 2 + 1;
+    int16_t * fixed = vs_aligned_malloc<int16_t>((dia + 1) * sizeof(int16_t), 32);
+    if (!fixed)
+        return nullptr;
+    double sum = 0.;
+    int previous = 0;
+    for (int k = 0; k < dia; k++) {
+        sum += weights[k];
+        const int current = (k == dia - 1) ? 1 << fixedWeightBits : static_cast<int>(sum * (1 << fixedWeightBits) + 0.5);
+        fixed[k] = static_cast<int16_t>(current - previous);
+        previous = current;
+    }
+    fixed[dia] = 0;
+    return fixed;
+}
+
 template<typename T>
-static void genConvV(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset) {
+void genConvV(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset) {
     weights += rad;
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
             float sum = 0.f;
-            for (int v = -rad; v <= rad; v++) {
-                int yc = y + v;
-                if (yc < 0)
-                    yc = -yc;
-                else if (yc >= height)
-                    yc = 2 * (height - 1) - yc;
-                sum += (srcp[x + yc * stride] + offset) * weights[v];
-            }
+            for (int v = -rad; v <= rad; v++)
+                sum += (srcp[x + reflect(y + v, height) * stride] + offset) * weights[v];
             dstp[x] = sum;
         }
         dstp += stride;
     }
 }
 
-static void genConvH(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights) {
+void genConvH(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights) {
     weights += rad;
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
             float sum = 0.f;
-            for (int v = -rad; v <= rad; v++) {
-                int xc = x + v;
-                if (xc < 0)
-                    xc = -xc;
-                else if (xc >= width)
-                    xc = 2 * (width - 1) - xc;
-                sum += srcp[xc] * weights[v];
-            }
+            for (int v = -rad; v <= rad; v++)
+                sum += srcp[reflect(x + v, width)] * weights[v];
             dstp[x] = sum;
         }
         srcp += stride;
@@ -113,6 +177,164 @@ static void genConvH(const float * srcp, float * VS_RESTRICT dstp, const int wid
     }
 }
 
+// Young and van Vliet, "Recursive implementation of the Gaussian filter", Signal Processing 44 (1995)
+static void iirCoefficients(const float sigma, float coeff[4]) {
+    const double q = (sigma >= 2.5f) ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1. - 0.26891 * sigma);
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    const double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    const double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    const double b3 = 0.422205 * q * q * q;
+    coeff[0] = static_cast<float>(1. - (b1 + b2 + b3) / b0);
+    coeff[1] = static_cast<float>(b1 / b0);
+    coeff[2] = static_cast<float>(b2 / b0);
+    coeff[3] = static_cast<float>(b3 / b0);
+}
+
+// Recursive gaussian blur, at a cost per pixel that does not depend on sigma
+static const int iirRows = 8;
+static const int iirColumns = 256;
+static const int iirBandHeight = 64;
+
+// Smallest sigma for which blur=0 picks the recursive blur over the gaussian kernel
+static const float iirCrossover = 5.f;
+
+template<typename T>
+static void iirVertical(const T * srcp, float * VS_RESTRICT dstp, const int x0, const int x1, const int height, const int stride, const float coeff[4],
+                        const float offset) {
+    const float g = coeff[0], a1 = coeff[1], a2 = coeff[2], a3 = coeff[3];
+
+    for (int x = x0; x < x1; x++)
+        dstp[x] = srcp[x] + offset;
+    for (int y = 1; y < height; y++) {
+        const T * s = srcp + y * stride;
+        float * w = dstp + y * stride;
+        const float * w1 = w - stride;
+        const float * w2 = dstp + std::max(y - 2, 0) * stride;
+        const float * w3 = dstp + std::max(y - 3, 0) * stride;
+        for (int x = x0; x < x1; x++)
+            w[x] = g * (s[x] + offset) + a1 * w1[x] + a2 * w2[x] + a3 * w3[x];
+    }
+    for (int y = height - 2; y >= 0; y--) {
+        float * w = dstp + y * stride;
+        const float * w1 = w + stride;
+        const float * w2 = dstp + std::min(y + 2, height - 1) * stride;
+        const float * w3 = dstp + std::min(y + 3, height - 1) * stride;
+        for (int x = x0; x < x1; x++)
+            w[x] = g * w[x] + a1 * w1[x] + a2 * w2[x] + a3 * w3[x];
+    }
+}
+
+static void iirHorizontal(float * VS_RESTRICT dstp, const int width, const int y0, const int y1, const int stride, const float coeff[4]) {
+    const float g = coeff[0], a1 = coeff[1], a2 = coeff[2], a3 = coeff[3];
+
+    for (int yb = y0; yb < y1; yb += iirRows) {
+        const int n = std::min(iirRows, y1 - yb);
+        float * rows = dstp + yb * stride;
+        float p1[iirRows], p2[iirRows], p3[iirRows];
+        for (int r = 0; r < n; r++)
+            p1[r] = p2[r] = p3[r] = rows[r * stride];
+        for (int x = 1; x < width; x++) {
+            for (int r = 0; r < n; r++) {
+                float * w = rows + r * stride;
+                const float v = g * w[x] + a1 * p1[r] + a2 * p2[r] + a3 * p3[r];
+                p3[r] = p2[r];
+                p2[r] = p1[r];
+                p1[r] = w[x] = v;
+            }
+        }
+        for (int r = 0; r < n; r++)
+            p1[r] = p2[r] = p3[r] = rows[r * stride + width - 1];
+        for (int x = width - 2; x >= 0; x--) {
+            for (int r = 0; r < n; r++) {
+                float * w = rows + r * stride;
+                const float v = g * w[x] + a1 * p1[r] + a2 * p2[r] + a3 * p3[r];
+                p3[r] = p2[r];
+                p2[r] = p1[r];
+                p1[r] = w[x] = v;
+            }
+        }
+    }
+}
+
+template<typename T>
+void iirBlur(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset) {
+    iirVertical<T>(srcp, dstp, 0, width, height, stride, coeff, offset);
+    iirHorizontal(dstp, width, 0, height, stride, coeff);
+}
+
+// Row y of the source filtered with `vertical` down the columns and then `horizontal` along the row
+template<typename T>
+static void separableRow(const T * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y,
+                         const float * vertical, const float * horizontal, const TCannyData * d, const float offset, StageTimer & timer) {
+    if (d->opt == 4) {
+        convV_avx512<T>(srcp, tmp, width, height, stride, y, d->grad, vertical, offset);
+        timer.lap(debugBlurV);
+        convH_avx512(tmp, dstp, width, d->grad, horizontal);
+    } else if (d->opt == 3) {
+        convV_avx2<T>(srcp, tmp, width, height, stride, y, d->grad, vertical, offset);
+        timer.lap(debugBlurV);
+        convH_avx2(tmp, dstp, width, d->grad, horizontal);
+    } else {
+        convV_sse2<T>(srcp, tmp, width, height, stride, y, d->grad, vertical, offset);
+        timer.lap(debugBlurV);
+        convH_sse2(tmp, dstp, width, d->grad, horizontal);
+    }
+    timer.lap(debugBlurH);
+}
+
+template<typename T>
+static void blurRow(const T * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y,
+                    const TCannyData * d, const float offset, StageTimer & timer) {
+    separableRow<T>(srcp, tmp, dstp, width, height, stride, y, d->weights, d->weights, d, offset, timer);
+}
+
+template<typename T>
+static void blurRow(const T * srcp, int16_t * VS_RESTRICT tmp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y,
+                    const TCannyData * d, const float offset, StageTimer & timer) {
+    const int shift = d->vi->format->bitsPerSample - 1;
+    if (d->opt == 4) {
+        convVFixed_avx512<T>(srcp, tmp, width, height, stride, y, d->grad, d->weightsFixed, shift);
+        timer.lap(debugBlurV);
+        convHFixed_avx512(tmp, dstp, width, d->grad, d->weightsFixed);
+    } else if (d->opt == 3) {
+        convVFixed_avx2<T>(srcp, tmp, width, height, stride, y, d->grad, d->weightsFixed, shift);
+        timer.lap(debugBlurV);
+        convHFixed_avx2(tmp, dstp, width, d->grad, d->weightsFixed);
+    } else {
+        convVFixed_sse2<T>(srcp, tmp, width, height, stride, y, d->grad, d->weightsFixed, shift);
+        timer.lap(debugBlurV);
+        convHFixed_sse2(tmp, dstp, width, d->grad, d->weightsFixed);
+    }
+    timer.lap(debugBlurH);
+}
+
+// fp16 outputs are computed in float a chunk of a row at a time and rounded to half
+static const int halfChunk = 256;
+
+static void storeHalf(const float * srcp, Half * VS_RESTRICT dstp, const int width, const TCannyData * d) {
+    if (d->opt == 4) {
+        storeHalf_avx512(srcp, dstp, width);
+    } else if (d->opt == 3) {
+        storeHalf_avx2(srcp, dstp, width);
+    } else if (d->opt == 2) {
+        storeHalf_sse2(srcp, dstp, width);
+    } else {
+        for (int x = 0; x < width; x++)
+            dstp[x] = srcp[x];
+    }
+}
+
+// Calls output(buffer, x, n) to write the float samples of columns [x, x + n) of a row into buffer, then rounds them into dstp
+template<typename F>
+static void halfRow(Half * VS_RESTRICT dstp, const int width, const TCannyData * d, F output) {
+    alignas(64) float buffer[halfChunk];
+    for (int x = 0; x < width; x += halfChunk) {
+        const int n = std::min(halfChunk, width - x);
+        output(buffer, x, n);
+        storeHalf(buffer, dstp + x, n, d);
+    }
+}
+
 template<typename T>
 static T getBin(const float dir, const int n) {
     const int bin = static_cast<int>(dir * (n / M_PIF) + 0.5f);
@@ -125,14 +347,70 @@ float getBin<float>(const float dir, const int n) {
     return (bin > static_cast<float>(n)) ? 0.f : bin;
 }
 
+// op 3 on the opt=1 path: dx into gximg, and -dy into gyimg as the vertical derivative runs downwards
+template<typename T>
+void derivativeImages(const T * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height,
+                      const int stride, const float offset, const TCannyData * d, StageTimer & timer) {
+    genConvV<T>(srcp, tmp, width, height, stride, d->grad, d->weights, offset);
+    timer.lap(debugBlurV);
+    genConvH(tmp, gximg, width, height, stride, d->grad, d->derivative);
+    timer.lap(debugBlurH);
+    genConvV<T>(srcp, tmp, width, height, stride, d->grad, d->derivative, 0.f);
+    timer.lap(debugBlurV);
+    genConvH(tmp, gyimg, width, height, stride, d->grad, d->weights);
+    timer.lap(debugBlurH);
+}
+
+// Adds the gradient magnitudes of one row to the statistics of stats
+static void gradientStats(const float * gmn, const uint8_t * selected, const int width, const TCannyData * d, EdgeStats & stats) {
+    const float binScale = statsBins / (d->gmmax * d->statsUnit);
+    float sum = 0.f, max = stats.max;
+    int pixels = width;
+    if (selected) {
+        pixels = 0;
+        for (int x = 0; x < width; x++) {
+            if (!selected[x])
+                continue;
+            sum += gmn[x];
+            max = std::max(max, gmn[x]);
+            stats.histogram[std::min(static_cast<int>(gmn[x] * binScale), statsBins - 1)]++;
+            pixels++;
+        }
+    } else {
+        for (int x = 0; x < width; x++) {
+            sum += gmn[x];
+            max = std::max(max, gmn[x]);
+            stats.histogram[std::min(static_cast<int>(gmn[x] * binScale), statsBins - 1)]++;
+        }
+    }
+    stats.pixels += pixels;
+    stats.sum += sum;
+    stats.max = max;
+}
+
+// Whole-plane gradient and suppression of the opt=1 path
+template<int op, int nms, int mode>
 static void gmDirImages(float * VS_RESTRICT srcp, float * VS_RESTRICT gimg, float * VS_RESTRICT dimg, const int width, const int height, const int stride,
-                        const int nms, const int mode, const int op) {
-    memset(gimg, 0, stride * height * sizeof(float));
-    memset(dimg, 0, stride * height * sizeof(float));
+                        const TCannyData * d, EdgeStats * stats, const uint8_t * selected, StageTimer & timer) {
+    const bool direction = mode != 1;
+    memset(gimg, 0, width * sizeof(float));
+    memset(gimg + (height - 1) * stride, 0, width * sizeof(float));
+    if (direction) {
+        memset(dimg, 0, width * sizeof(float));
+        memset(dimg + (height - 1) * stride, 0, width * sizeof(float));
+    }
+    if (stats) {
+        gradientStats(gimg, selected, width, d, *stats);
+        if (height > 1)
+            gradientStats(gimg + (height - 1) * stride, selected ? selected + (height - 1) * stride : nullptr, width, d, *stats);
+    }
     float * VS_RESTRICT srcpT = srcp + stride;
     float * VS_RESTRICT gmnT = gimg + stride;
     float * VS_RESTRICT dirT = dimg + stride;
     for (int y = 1; y < height - 1; y++) {
+        gmnT[0] = gmnT[width - 1] = 0.f;
+        if (direction)
+            dirT[0] = dirT[width - 1] = 0.f;
         for (int x = 1; x < width - 1; x++) {
             float dx, dy;
             if (op == 0) {
@@ -141,30 +419,41 @@ static void gmDirImages(float * VS_RESTRICT srcp, float * VS_RESTRICT gimg, floa
             } else if (op == 1) {
                 dx = (srcpT[x - stride + 1] + srcpT[x + 1] + srcpT[x + stride + 1] - srcpT[x - stride - 1] - srcpT[x - 1] - srcpT[x + stride - 1]) / 2.f;
                 dy = (srcpT[x - stride - 1] + srcpT[x - stride] + srcpT[x - stride + 1] - srcpT[x + stride - 1] - srcpT[x + stride] - srcpT[x + stride + 1]) / 2.f;
-            } else {
+            } else if (op == 2) {
                 dx = srcpT[x - stride + 1] + 2.f * srcpT[x + 1] + srcpT[x + stride + 1] - srcpT[x - stride - 1] - 2.f * srcpT[x - 1] - srcpT[x + stride - 1];
                 dy = srcpT[x - stride - 1] + 2.f * srcpT[x - stride] + srcpT[x - stride + 1] - srcpT[x + stride - 1] - 2.f * srcpT[x + stride] - srcpT[x + stride + 1];
+            } else {
+                dx = srcpT[x];
+                dy = -dirT[x];
             }
             gmnT[x] = std::sqrt(dx * dx + dy * dy);
-            if (mode == 1)
-                continue;
-            const float dr = std::atan2(dy, dx);
-            dirT[x] = dr + (dr < 0.f ? M_PIF : 0.f);
+            if (direction) {
+                const float dr = std::atan2(dy, dx);
+                dirT[x] = dr + (dr < 0.f ? M_PIF : 0.f);
+            }
         }
+        if (stats)
+            gradientStats(gmnT, selected ? selected + y * stride : nullptr, width, d, *stats);
         srcpT += stride;
         gmnT += stride;
         dirT += stride;
     }
-    memcpy(srcp, gimg, stride * height * sizeof(float));
-    if (mode & 1)
+    timer.lap(debugGradient);
+    if (mode != 0)
         return;
+    // Only the suppressed plane is read after this, so the borders are the only rows of srcp that need the magnitude copied
+    memcpy(srcp, gimg, width * sizeof(float));
+    memcpy(srcp + (height - 1) * stride, gimg + (height - 1) * stride, width * sizeof(float));
     const int offTable[4] = { 1, -stride + 1, -stride, -stride - 1 };
     srcpT = srcp + stride;
     gmnT = gimg + stride;
     dirT = dimg + stride;
     for (int y = 1; y < height - 1; y++) {
+        srcpT[0] = gmnT[0];
+        srcpT[width - 1] = gmnT[width - 1];
         for (int x = 1; x < width - 1; x++) {
             const float dir = dirT[x];
+            srcpT[x] = gmnT[x];
             if (nms & 1) {
                 const int off = offTable[getBin<int>(dir, 4)];
                 if (gmnT[x] >= std::max(gmnT[x + off], gmnT[x - off]))
@@ -199,11 +488,237 @@ static void gmDirImages(float * VS_RESTRICT srcp, float * VS_RESTRICT gimg, floa
         gmnT += stride;
         dirT += stride;
     }
+    timer.lap(debugNMS);
+}
+
+// Gradient of one row of the fused pipeline, from three consecutive blurred rows
+template<int op, typename B>
+static void gradientRow(const B * above, const B * center, const B * below, float * VS_RESTRICT gmn, float * VS_RESTRICT gx, float * VS_RESTRICT gy,
+                        const int width, const float scale) {
+    typedef typename std::conditional<std::is_integral<B>::value, int, float>::type A;
+    const float norm = (op == 1) ? scale / 2.f : scale;
+    for (int x = 1; x < width - 1; x++) {
+        A ix, iy;
+        if (op == 0) {
+            ix = center[x + 1] - center[x - 1];
+            iy = above[x] - below[x];
+        } else if (op == 1) {
+            ix = above[x + 1] + center[x + 1] + below[x + 1] - above[x - 1] - center[x - 1] - below[x - 1];
+            iy = above[x - 1] + above[x] + above[x + 1] - below[x - 1] - below[x] - below[x + 1];
+        } else {
+            ix = above[x + 1] + 2 * center[x + 1] + below[x + 1] - above[x - 1] - 2 * center[x - 1] - below[x - 1];
+            iy = above[x - 1] + 2 * above[x] + above[x + 1] - below[x - 1] - 2 * below[x] - below[x + 1];
+        }
+        const float dx = ix * norm;
+        const float dy = iy * norm;
+        gx[x] = dx;
+        gy[x] = dy;
+        gmn[x] = std::sqrt(dx * dx + dy * dy);
+    }
+    gmn[0] = gmn[width - 1] = 0.f;
+    gx[0] = gx[width - 1] = gy[0] = gy[width - 1] = 0.f;
+}
+
+// Gradient of op 3 for row y, straight from the source with separable derivative-of-gaussian filters
+template<typename T>
+static void derivativeRow(const T * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gmn, float * VS_RESTRICT gx, float * VS_RESTRICT gy, const int width,
+                          const int height, const int stride, const int y, const TCannyData * d, const float offset, StageTimer & timer) {
+    separableRow<T>(srcp, tmp, gx, width, height, stride, y, d->weights, d->derivative, d, offset, timer);
+    separableRow<T>(srcp, tmp, gy, width, height, stride, y, d->derivative, d->weights, d, 0.f, timer);
+    for (int x = 1; x < width - 1; x++) {
+        const float dx = gx[x];
+        const float dy = -gy[x];
+        gy[x] = dy;
+        gmn[x] = std::sqrt(dx * dx + dy * dy);
+    }
+    gmn[0] = gmn[width - 1] = 0.f;
+    gx[0] = gx[width - 1] = gy[0] = gy[width - 1] = 0.f;
+}
+
+// Sample values of the mode 1 and mode 2/3 outputs, which the row sweep writes without an intermediate float plane
+template<typename T>
+static inline T scaleMagnitude(const float gmn, const float magnitude, const int peak, const float offset, const float upper) {
+    return std::min(static_cast<int>(gmn * magnitude + 0.5f), peak);
+}
+
+template<>
+inline float scaleMagnitude<float>(const float gmn, const float magnitude, const int peak, const float offset, const float upper) {
+    return std::min(gmn * magnitude - offset, upper);
+}
+
+template<typename T>
+static inline T binDirection(const float dir, const int bins, const float offset) {
+    return getBin<T>(dir, bins);
+}
+
+template<>
+inline float binDirection<float>(const float dir, const int bins, const float offset) {
+    return getBin<float>(dir, bins) - offset;
+}
+
+template<typename T>
+static void magnitudeRow(const float * gmn, T * VS_RESTRICT dstp, const int width, const int plane, const float offset, const TCannyData * d) {
+    for (int x = 0; x < width; x++)
+        dstp[x] = scaleMagnitude<T>(gmn[x], d->magnitude, d->peak, offset, d->upper[plane]);
+}
+
+template<>
+void magnitudeRow<Half>(const float * gmn, Half * VS_RESTRICT dstp, const int width, const int plane, const float offset, const TCannyData * d) {
+    halfRow(dstp, width, d, [&](float * buffer, const int x, const int n) { magnitudeRow<float>(gmn + x, buffer, n, plane, offset, d); });
+}
+
+// The gradient is zero in the first and last columns and rows, so their direction is binned from there as well
+template<typename T>
+static void directionRow(const float * gx, const float * gy, T * VS_RESTRICT dstp, const int width, const float offset, const TCannyData * d) {
+    for (int x = 0; x < width; x++) {
+        const float dr = std::atan2(gy[x], gx[x]);
+        dstp[x] = binDirection<T>(dr + (dr < 0.f ? M_PIF : 0.f), d->bins, offset);
+    }
+}
+
+template<>
+void directionRow<Half>(const float * gx, const float * gy, Half * VS_RESTRICT dstp, const int width, const float offset, const TCannyData * d) {
+    halfRow(dstp, width, d, [&](float * buffer, const int x, const int n) { directionRow<float>(gx + x, gy + x, buffer, n, offset, d); });
+}
+
+// What the fused pipeline keeps of the suppressed magnitude of a pixel
+enum EdgeClass : uint8_t { edgeNone, edgeWeak, edgeStrong };
+
+static inline uint8_t classify(const float val, const float t_h, const float t_l) {
+    return (val >= t_h) ? edgeStrong : (val > t_l ? edgeWeak : edgeNone);
+}
+
+static void classifyRow(const float * gmn, uint8_t * VS_RESTRICT dstp, const int width, const float t_h, const float t_l) {
+    for (int x = 0; x < width; x++)
+        dstp[x] = classify(gmn[x], t_h, t_l);
+}
+
+// Suppression of one row of the fused pipeline, binning the direction without atan2
+template<int nms>
+static void nmsRow(const float * above, const float * gmn, const float * below, const float * gx, const float * gy, uint8_t * VS_RESTRICT dstp, const int width,
+                   const float t_h, const float t_l) {
+    const float tan1 = 0.414213562f;
+    const float tan3 = 2.414213562f;
+    dstp[0] = classify(gmn[0], t_h, t_l);
+    for (int x = 1; x < width - 1; x++) {
+        const float left = gmn[x - 1], center = gmn[x], right = gmn[x + 1];
+        const float aboveL = above[x - 1], aboveC = above[x], aboveR = above[x + 1];
+        const float belowL = below[x - 1], belowC = below[x], belowR = below[x + 1];
+
+        const float dx = (gy[x] < 0.f) ? -gx[x] : gx[x];
+        const float adx = std::abs(dx);
+        const float ady = std::abs(gy[x]);
+        const bool positive = dx >= 0.f;
+        const float diag1 = positive ? aboveR : aboveL;
+        const float diag2 = positive ? belowL : belowR;
+
+        bool keep = false;
+        if (nms & 1) {
+            const bool horizontal = ady <= tan1 * adx;
+            const bool vertical = ady > tan3 * adx;
+            const float n1 = horizontal ? right : (vertical ? aboveC : diag1);
+            const float n2 = horizontal ? left : (vertical ? belowC : diag2);
+            keep |= center >= std::max(n1, n2);
+        }
+
+        if (nms & 2) {
+            const bool steep = ady > adx;
+            const float t = std::min(adx, ady) / std::max(std::max(adx, ady), FLT_MIN);
+            const float a1 = steep ? aboveC : (positive ? right : left);
+            const float a2 = steep ? belowC : (positive ? left : right);
+            const float val1 = (1.f - t) * a1 + t * diag1;
+            const float val2 = (1.f - t) * a2 + t * diag2;
+            keep |= center >= std::max(val1, val2);
+        }
+
+        dstp[x] = keep ? classify(center, t_h, t_l) : edgeNone;
+    }
+    dstp[width - 1] = classify(gmn[width - 1], t_h, t_l);
 }
 
-static void hystersis(float * VS_RESTRICT srcp, Stack & VS_RESTRICT stack, const int width, const int height, const int stride, const float t_h, const float t_l) {
+static void addStats(EdgeStats & stats, const EdgeStats & other) {
+    stats.pixels += other.pixels;
+    stats.edges += other.edges;
+    stats.sum += other.sum;
+    stats.max = std::max(stats.max, other.max);
+    for (int i = 0; i < statsBins; i++)
+        stats.histogram[i] += other.histogram[i];
+}
+
+// Blur, gradient and suppression of the rows [y0, y1) of one plane in a single sweep
+template<typename T, typename B, int op, int nms>
+static void fusedBand(const void * source, const SweepTargets & out, const float * blurred, float * VS_RESTRICT rows, const int width, const int height,
+                      const int stride, const int y0, const int y1, const int plane, const TCannyData * d, const float offset, StageTimer & timer) {
+    const T * srcp = static_cast<const T *>(source);
+    T * magnitude = static_cast<T *>(out.magnitude);
+    T * direction = static_cast<T *>(out.direction);
+    const float scale = std::is_integral<B>::value ? 1.f / (1 << (15 - d->vi->format->bitsPerSample)) : 1.f;
+    B * tmp = reinterpret_cast<B *>(rows);
+    B * ring[3];
+    const B * blur[3];
+    float * gmn[3], * gx[3], * gy[3];
+    for (int i = 0; i < 3; i++) {
+        ring[i] = reinterpret_cast<B *>(rows + (1 + i) * stride);
+        gmn[i] = rows + (4 + i) * stride;
+        gx[i] = rows + (7 + i) * stride;
+        gy[i] = rows + (10 + i) * stride;
+    }
+
+    for (int y = std::max(y0 - 2, 0); y < y1 + 2; y++) {
+        if (op != 3 && y < height) {
+            // Only float pipelines are run with the recursive blur
+            if (blurred) {
+                blur[y % 3] = reinterpret_cast<const B *>(blurred + y * stride);
+            } else {
+                blurRow<T>(srcp, tmp, ring[y % 3], width, height, stride, y, d, offset, timer);
+                blur[y % 3] = ring[y % 3];
+            }
+        }
+
+        const int ry = y - 1;
+        if (ry >= std::max(y0 - 1, 0) && ry < height) {
+            float * g = gmn[ry % 3];
+            const bool border = ry == 0 || ry == height - 1;
+            if (!border && op == 3) {
+                derivativeRow<T>(srcp, reinterpret_cast<float *>(tmp), g, gx[ry % 3], gy[ry % 3], width, height, stride, ry, d, offset, timer);
+            } else if (!border) {
+                gradientRow<op>(blur[(ry - 1) % 3], blur[ry % 3], blur[(ry + 1) % 3], g, gx[ry % 3], gy[ry % 3], width, scale);
+            } else {
+                memset(g, 0, width * sizeof(float));
+                memset(gx[ry % 3], 0, width * sizeof(float));
+                memset(gy[ry % 3], 0, width * sizeof(float));
+            }
+            if (out.stats && ry >= y0 && ry < y1)
+                gradientStats(g, out.selected ? out.selected + ry * stride : nullptr, width, d, *out.stats);
+            timer.lap(debugGradient);
+
+            if (ry >= y0 && ry < y1) {
+                if (magnitude)
+                    magnitudeRow<T>(g, magnitude + ry * stride, width, plane, offset, d);
+                if (direction)
+                    directionRow<T>(gx[ry % 3], gy[ry % 3], direction + ry * stride, width, offset, d);
+                timer.lap(debugOutput);
+            }
+        }
+
+        const int ny = y - 2;
+        if (out.edges && ny >= y0 && ny < y1) {
+            if (ny > 0 && ny < height - 1)
+                nmsRow<nms>(gmn[(ny - 1) % 3], gmn[ny % 3], gmn[(ny + 1) % 3], gx[ny % 3], gy[ny % 3], out.edges + ny * stride, width, d->t_h, d->t_l);
+            else
+                classifyRow(gmn[ny % 3], out.edges + ny * stride, width, d->t_h, d->t_l);
+            timer.lap(debugNMS);
+        }
+    }
+}
+
+// edgeStats counts the edges at the pixels marked in `selected`, or at every pixel if it is null
+void hystersis(float * VS_RESTRICT srcp, Stack & VS_RESTRICT stack, const int width, const int height, const int stride, const float t_h, const float t_l,
+               PlaneStats * stats, EdgeStats * edgeStats, const uint8_t * selected) {
     memset(stack.map, 0, width * height);
     stack.index = -1;
+    int64_t seeds = 0, visited = 0, edges = 0;
+    int depth = 0;
     for (int y = 1; y < height - 1; y++) {
         for (int x = 1; x < width - 1; x++) {
             if (srcp[x + y * stride] < t_h || stack.map[x + y * width])
@@ -211,6 +726,9 @@ static void hystersis(float * VS_RESTRICT srcp, Stack & VS_RESTRICT stack, const
             srcp[x + y * stride] = FLT_MAX;
             stack.map[x + y * width] = UINT8_MAX;
             push(stack, x, y);
+            seeds++;
+            visited++;
+            edges += !selected || selected[x + y * stride];
             while (stack.index > -1) {
                 const std::pair<int, int> pos = pop(stack);
                 const int xMin = (pos.first > 1) ? pos.first - 1 : 1;
@@ -223,11 +741,179 @@ static void hystersis(float * VS_RESTRICT srcp, Stack & VS_RESTRICT stack, const
                             srcp[xx + yy * stride] = FLT_MAX;
                             stack.map[xx + yy * width] = UINT8_MAX;
                             push(stack, xx, yy);
+                            visited++;
+                            edges += !selected || selected[xx + yy * stride];
                         }
                     }
                 }
+                depth = std::max(depth, stack.index + 1);
+            }
+        }
+    }
+
+    if (stats) {
+        stats->seeds = seeds;
+        stats->visited = visited;
+        stats->depth = depth;
+    }
+    if (edgeStats)
+        edgeStats->edges += edges;
+}
+
+// Banded hysteresis over the edge classes of the fused pipeline, as a union-find over horizontal runs
+static const int hysteresisBandHeight = 64;
+
+static void countRuns(const uint8_t * srcp, int * VS_RESTRICT rowRuns, const int width, const int y0, const int y1, const int stride) {
+    for (int y = y0; y < y1; y++) {
+        const uint8_t * row = srcp + y * stride;
+        int count = 0;
+        bool inside = false;
+        for (int x = 1; x < width - 1; x++) {
+            const bool candidate = row[x] != edgeNone;
+            count += candidate && !inside;
+            inside = candidate;
+        }
+        rowRuns[y] = count;
+    }
+}
+
+static int findRoot(Run * runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+static void unite(Run * runs, int a, int b) {
+    a = findRoot(runs, a);
+    b = findRoot(runs, b);
+    if (a == b)
+        return;
+    if (a > b)
+        std::swap(a, b);
+    runs[b].parent = a;
+    runs[a].seeded |= runs[b].seeded;
+}
+
+static void uniteRows(Run * runs, const int prevBegin, const int prevEnd, const int curBegin, const int curEnd) {
+    int i = prevBegin;
+    for (int j = curBegin; j < curEnd; j++) {
+        while (i < prevEnd && runs[i].x1 < runs[j].x0 - 1)
+            i++;
+        for (int k = i; k < prevEnd && runs[k].x0 <= runs[j].x1 + 1; k++)
+            unite(runs, k, j);
+    }
+}
+
+static void labelRuns(const uint8_t * srcp, Run * runs, const int * rowStart, const int width, const int y0, const int y1, const int stride) {
+    for (int y = y0; y < y1; y++) {
+        const uint8_t * row = srcp + y * stride;
+        int n = rowStart[y];
+        for (int x = 1; x < width - 1;) {
+            if (row[x] == edgeNone) {
+                x++;
+                continue;
+            }
+            Run & run = runs[n];
+            run.x0 = x;
+            run.parent = n;
+            run.seeded = false;
+            for (; x < width - 1 && row[x] != edgeNone; x++)
+                run.seeded |= row[x] == edgeStrong;
+            run.x1 = x - 1;
+            n++;
+        }
+        if (y > y0)
+            uniteRows(runs, rowStart[y - 1], rowStart[y], rowStart[y], rowStart[y + 1]);
+    }
+}
+
+static void fillRuns(uint8_t * VS_RESTRICT srcp, const Run * runs, const int * rowStart, const int y0, const int y1, const int stride) {
+    for (int y = y0; y < y1; y++) {
+        uint8_t * row = srcp + y * stride;
+        for (int i = rowStart[y]; i < rowStart[y + 1]; i++) {
+            if (runs[runs[i].parent].seeded)
+                memset(row + runs[i].x0, edgeStrong, runs[i].x1 - runs[i].x0 + 1);
+        }
+    }
+}
+
+void hysteresisBands(uint8_t * VS_RESTRICT srcp, std::vector<Run> & runs, std::vector<int> & rowStart, const int width, const int height, const int stride,
+                     const TCannyData * d, PlaneStats * stats, EdgeStats * edgeStats, const uint8_t * selected) {
+    if (width < 3 || height < 3)
+        return;
+
+    std::atomic<int64_t> * times = stats ? stats->time : nullptr;
+    const int bands = (height - 2 + hysteresisBandHeight - 1) / hysteresisBandHeight;
+    auto bandEnd = [height](const int y0) { return std::min(y0 + hysteresisBandHeight, height - 1); };
+
+    rowStart.resize(height + 1);
+    parallelFor(d, bands, [&](const int i) {
+        StageTimer timer(times);
+        const int y0 = 1 + i * hysteresisBandHeight;
+        countRuns(srcp, rowStart.data(), width, y0, bandEnd(y0), stride);
+        timer.lap(debugHysteresis);
+    });
+
+    StageTimer timer(times);
+
+    int total = 0;
+    for (int y = 1; y < height - 1; y++) {
+        const int count = rowStart[y];
+        rowStart[y] = total;
+        total += count;
+    }
+    rowStart[0] = 0;
+    rowStart[height - 1] = total;
+    timer.lap(debugHysteresis);
+    if (!total)
+        return;
+    runs.resize(total);
+
+    parallelFor(d, bands, [&](const int i) {
+        StageTimer timer(times);
+        const int y0 = 1 + i * hysteresisBandHeight;
+        labelRuns(srcp, runs.data(), rowStart.data(), width, y0, bandEnd(y0), stride);
+        timer.lap(debugHysteresis);
+    });
+
+    timer.lap(debugHysteresis);
+    for (int y0 = 1 + hysteresisBandHeight; y0 < height - 1; y0 += hysteresisBandHeight)
+        uniteRows(runs.data(), rowStart[y0 - 1], rowStart[y0], rowStart[y0], rowStart[y0 + 1]);
+
+    for (int i = 0; i < total; i++)
+        runs[i].parent = runs[runs[i].parent].parent;
+    timer.lap(debugHysteresis);
+
+    parallelFor(d, bands, [&](const int i) {
+        StageTimer timer(times);
+        const int y0 = 1 + i * hysteresisBandHeight;
+        fillRuns(srcp, runs.data(), rowStart.data(), y0, bandEnd(y0), stride);
+        timer.lap(debugHysteresis);
+    });
+
+    // The edges are the pixels of the seeded runs
+    if (stats || edgeStats) {
+        int64_t seeds = 0, visited = 0, edges = 0;
+        for (int y = 1; y < height - 1; y++) {
+            const uint8_t * row = selected ? selected + y * stride : nullptr;
+            for (int i = rowStart[y]; i < rowStart[y + 1]; i++) {
+                if (!runs[runs[i].parent].seeded)
+                    continue;
+                seeds += runs[i].parent == i;
+                visited += runs[i].x1 - runs[i].x0 + 1;
+                if (row)
+                    edges += std::count(row + runs[i].x0, row + runs[i].x1 + 1, 1);
             }
         }
+        if (stats) {
+            stats->runs = total;
+            stats->seeds += seeds;
+            stats->visited += visited;
+        }
+        if (edgeStats)
+            edgeStats->edges += selected ? edges : visited;
     }
 }
 
@@ -341,225 +1027,1435 @@ void discretizeDM<float>(const float * dimg, float * VS_RESTRICT dstp, const int
 }
 
 template<typename T>
-static void TCanny(const VSFrameRef * src, VSFrameRef * dst, float * VS_RESTRICT fa[3], Stack & VS_RESTRICT stack, const TCannyData * d, const VSAPI * vsapi) {
-    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
-        if (d->process[plane]) {
-            const int width = vsapi->getFrameWidth(src, plane);
-            const int height = vsapi->getFrameHeight(src, plane);
-            const int stride = vsapi->getStride(src, plane) / sizeof(T);
-            const T * srcp = reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
-            T * VS_RESTRICT dstp = reinterpret_cast<T *>(vsapi->getWritePtr(dst, plane));
-            const float offset = (d->vi->format->sampleType == stInteger || plane == 0 || d->vi->format->colorFamily == cmRGB) ? 0.f : 0.5f;
-
-            genConvV<T>(srcp, fa[1], width, height, stride, d->grad, d->weights, offset);
-            genConvH(fa[1], fa[0], width, height, stride, d->grad, d->weights);
-
-            if (d->mode != -1)
-                gmDirImages(fa[0], fa[1], fa[2], width, height, stride, d->nms, d->mode, d->op);
-
-            if (!(d->mode & 1))
-                hystersis(fa[0], stack, width, height, stride, d->t_h, d->t_l);
-
-            if (d->mode == -1)
-                outputGB<T>(fa[0], dstp, width, height, stride, d->peak, offset, d->lower[plane], d->upper[plane]);
-            else if (d->mode == 0)
-                binarizeCE<T>(fa[0], dstp, width, height, stride, d->t_h, d->peak, d->lower[plane], d->upper[plane]);
-            else if (d->mode == 1)
-                discretizeGM<T>(fa[1], dstp, width, height, stride, d->magnitude, d->peak, offset, d->upper[plane]);
-            else if (d->mode == 2)
-                discretizeDM_T<T>(fa[0], fa[2], dstp, width, height, stride, d->t_h, d->bins, offset, d->lower[plane]);
-            else
-                discretizeDM<T>(fa[2], dstp, width, height, stride, d->bins, offset);
-        }
+void outputRows(float * fa[3], T * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset,
+                const int mode, const TCannyData * d) {
+    if (mode == -1)
+        outputGB<T>(fa[0], dstp, width, height, stride, d->peak, offset, d->lower[plane], d->upper[plane]);
+    else if (mode == 0)
+        binarizeCE<T>(fa[0], dstp, width, height, stride, d->t_h, d->peak, d->lower[plane], d->upper[plane]);
+    else if (mode == 1)
+        discretizeGM<T>(fa[1], dstp, width, height, stride, d->magnitude, d->peak, offset, d->upper[plane]);
+    else if (mode == 2)
+        discretizeDM_T<T>(fa[0], fa[2], dstp, width, height, stride, d->t_h, d->bins, offset, d->lower[plane]);
+    else
+        discretizeDM<T>(fa[2], dstp, width, height, stride, d->bins, offset);
+}
+
+template<>
+void outputRows<Half>(float * fa[3], Half * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset,
+                      const int mode, const TCannyData * d) {
+    for (int y = 0; y < height; y++) {
+        halfRow(dstp + y * stride, width, d, [&](float * buffer, const int x, const int n) {
+            float * fr[3];
+            for (int k = 0; k < 3; k++)
+                fr[k] = fa[k] ? fa[k] + y * stride + x : nullptr;
+            outputRows<float>(fr, buffer, n, 1, stride, plane, offset, mode, d);
+        });
     }
 }
 
-static void VS_CC tcannyInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    TCannyData * d = static_cast<TCannyData *>(*instanceData);
-    vsapi->setVideoInfo(d->vi, 1, node);
+// Mode -1 of the fused pipeline, from blurred rows
+template<typename T>
+static void outputBlurred(const float * blurred, T * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset,
+                          const TCannyData * d) {
+    outputGB<T>(blurred, dstp, width, height, stride, d->peak, offset, d->lower[plane], d->upper[plane]);
 }
 
-static const VSFrameRef *VS_CC tcannyGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    const TCannyData * d = static_cast<const TCannyData *>(*instanceData);
+template<>
+void outputBlurred<Half>(const float * blurred, Half * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset,
+                         const TCannyData * d) {
+    for (int y = 0; y < height; y++) {
+        halfRow(dstp + y * stride, width, d, [&](float * buffer, const int x, const int n) {
+            outputGB<float>(blurred + y * stride + x, buffer, n, 1, stride, d->peak, offset, d->lower[plane], d->upper[plane]);
+        });
+    }
+}
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef * src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        const VSFrameRef * fr[] = { d->process[0] ? nullptr : src, d->process[1] ? nullptr : src, d->process[2] ? nullptr : src };
-        const int pl[] = { 0, 1, 2 };
-        VSFrameRef * dst = vsapi->newVideoFrame2(d->vi->format, d->vi->width, d->vi->height, fr, pl, src, core);
+// Mode 0 and 2 outputs of the fused pipeline, from the edge classes after the hysteresis
+template<typename T>
+static void binarizeEdges(const uint8_t * edges, T * VS_RESTRICT dstp, const int width, const int height, const int stride, const int dstStride,
+                          const T on, const T off) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            dstp[x] = (edges[x] == edgeStrong) ? on : off;
+        edges += stride;
+        dstp += dstStride;
+    }
+}
 
-        float * fa[3];
-        for (int i = 0; i < 3; i++) {
-            fa[i] = vs_aligned_malloc<float>(vsapi->getStride(src, 0) / d->vi->format->bytesPerSample * d->vi->height * sizeof(float), 32);
-            if (!fa[i]) {
-                vsapi->setFilterError("TCanny: malloc failure (fa)", frameCtx);
-                vsapi->freeFrame(src);
-                vsapi->freeFrame(dst);
-                return nullptr;
-            }
-        }
+template<typename T>
+static void maskDirection(const uint8_t * edges, const T * dir, T * dstp, const int width, const int height, const int stride, const T off) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            dstp[x] = (edges[x] == edgeStrong) ? dir[x] : off;
+        edges += stride;
+        dir += stride;
+        dstp += stride;
+    }
+}
 
-        Stack stack = {};
-        if (!(d->mode & 1)) {
-            stack.map = vs_aligned_malloc<uint8_t>(d->vi->width * d->vi->height, 32);
-            stack.pos = vs_aligned_malloc<std::pair<int, int>>(d->vi->width * d->vi->height * sizeof(std::pair<int, int>), 32);
-            if (!stack.map || !stack.pos) {
-                vsapi->setFilterError("TCanny: malloc failure (stack)", frameCtx);
-                vsapi->freeFrame(src);
-                vsapi->freeFrame(dst);
-                return nullptr;
-            }
-        }
+// Rows [y0, y0 + height) of an output of the fused pipeline. The sweep has already written modes 1 and 3 in full.
+template<typename T>
+void outputSweepRows(const SweepTargets & out, const float * blurred, T * dstp, const int width, const int y0, const int height,
+                     const int stride, const int plane, const float offset, const int mode, const TCannyData * d) {
+    const T on = static_cast<T>(std::is_integral<T>::value ? d->peak : d->upper[plane]);
+    const T off = static_cast<T>(std::is_integral<T>::value ? 0.f : d->lower[plane]);
+    dstp += y0 * stride;
+    if (mode == -1)
+        outputBlurred<T>(blurred + y0 * stride, dstp, width, height, stride, plane, offset, d);
+    else if (mode == 0)
+        binarizeEdges<T>(out.edges + y0 * stride, dstp, width, height, stride, stride, on, off);
+    else if (mode == 2)
+        maskDirection<T>(out.edges + y0 * stride, static_cast<const T *>(out.direction) + y0 * stride, dstp, width, height, stride, off);
+}
 
-        if (d->vi->format->sampleType == stInteger) {
-            if (d->vi->format->bitsPerSample == 8)
-                TCanny<uint8_t>(src, dst, fa, stack, d, vsapi);
-            else
-                TCanny<uint16_t>(src, dst, fa, stack, d, vsapi);
+// Rows [y0, y0 + height) of the 8-bit mode 0 output of mask8, with 255 for edges whatever the input format
+static void outputMaskRows(const float * fa0, const uint8_t * edges, uint8_t * VS_RESTRICT dstp, const int width, const int y0, const int height,
+                           const int stride, const int dstStride, const TCannyData * d) {
+    if (edges) {
+        binarizeEdges<uint8_t>(edges + y0 * stride, dstp + y0 * dstStride, width, height, stride, dstStride, UINT8_MAX, 0);
+    } else {
+        for (int y = y0; y < y0 + height; y++)
+            binarizeCE<uint8_t>(fa0 + y * stride, dstp + y * dstStride, width, 1, stride, d->t_h, UINT8_MAX, 0.f, 0.f);
+    }
+}
+
+// Mode -1 with the kernel blur, blurred row by row straight into the output frame
+template<typename T, typename B>
+void blurBand(const T * srcp, T * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride,
+              const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer) {
+    const float scale = std::is_integral<B>::value ? 1.f / (1 << (15 - d->vi->format->bitsPerSample)) : 1.f;
+    B * tmp = reinterpret_cast<B *>(rows);
+    B * fixed = reinterpret_cast<B *>(rows + stride);
+    float * blurred = rows + 2 * stride;
+
+    for (int y = y0; y < y1; y++) {
+        if (std::is_integral<B>::value) {
+            blurRow<T>(srcp, tmp, fixed, width, height, stride, y, d, offset, timer);
+            for (int x = 0; x < width; x++)
+                blurred[x] = fixed[x] * scale;
+            timer.lap(debugBlurH);
         } else {
-            TCanny<float>(src, dst, fa, stack, d, vsapi);
+            blurRow<T>(srcp, tmp, reinterpret_cast<B *>(blurred), width, height, stride, y, d, offset, timer);
         }
-
-        vsapi->freeFrame(src);
-        for (int i = 0; i < 3; i++)
-            vs_aligned_free(fa[i]);
-        vs_aligned_free(stack.map);
-        vs_aligned_free(stack.pos);
-        return dst;
+        outputBlurred<T>(blurred, dstp + y * stride, width, 1, stride, plane, offset, d);
+        timer.lap(debugOutput);
     }
+}
 
-    return nullptr;
+// Ring buffers for one band, reused from a band that is done or allocated if every one is in use; null if the allocation fails
+static float * acquireRows(TCannyData * d, const int stride) {
+    std::lock_guard<std::mutex> lock(d->scratchMutex);
+
+    if (!d->idleRows.empty()) {
+        float * rows = d->idleRows.back();
+        d->idleRows.pop_back();
+        return rows;
+    }
+    const size_t rowsSize = static_cast<size_t>(stride) * 13 * sizeof(float);
+    float * rows = vs_aligned_malloc<float>(rowsSize, 32);
+    if (rows) {
+        d->rows.push_back(rows);
+        d->scratchBytes += rowsSize;
+    }
+    return rows;
 }
 
-static void VS_CC tcannyFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    TCannyData * d = static_cast<TCannyData *>(instanceData);
-    vsapi->freeNode(d->node);
-    vs_aligned_free(d->weights);
-    delete d;
+static void releaseRows(TCannyData * d, float * rows) {
+    std::lock_guard<std::mutex> lock(d->scratchMutex);
+    d->idleRows.push_back(rows);
 }
 
-static void VS_CC tcannyCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    TCannyData d;
-    int err;
+static inline bool selected(const uint8_t value) { return value != 0; }
+static inline bool selected(const uint16_t value) { return value != 0; }
+static inline bool selected(const Half value) { return static_cast<float>(value) > 0.f; }
+static inline bool selected(const float value) { return value > 0.f; }
 
-    d.sigma = static_cast<float>(vsapi->propGetFloat(in, "sigma", 0, &err));
-    if (err)
-        d.sigma = 1.5f;
-    d.t_h = static_cast<float>(vsapi->propGetFloat(in, "t_h", 0, &err));
-    if (err)
-        d.t_h = 8.f;
-    d.t_l = static_cast<float>(vsapi->propGetFloat(in, "t_l", 0, &err));
-    if (err)
-        d.t_l = 1.f;
-    d.nms = int64ToIntS(vsapi->propGetInt(in, "nms", 0, &err));
-    if (err)
-        d.nms = 3;
-    d.mode = int64ToIntS(vsapi->propGetInt(in, "mode", 0, &err));
-    d.op = int64ToIntS(vsapi->propGetInt(in, "op", 0, &err));
-    if (err)
-        d.op = 1;
-    d.gmmax = static_cast<float>(vsapi->propGetFloat(in, "gmmax", 0, &err));
-    if (err)
-        d.gmmax = 50.f;
+template<typename T>
+static void insideRows(const uint8_t * srcp, uint8_t * VS_RESTRICT inside, const int stride, const TCannyData * d) {
+    for (int y = d->roi[1]; y < d->roi[3]; y++) {
+        const T * row = reinterpret_cast<const T *>(srcp + y * stride);
+        for (int x = d->roi[0]; x < d->roi[2]; x++)
+            inside[y * d->vi->width + x] = selected(row[x]);
+    }
+}
 
-    if (d.sigma <= 0.f) {
-        vsapi->setError(out, "TCanny: sigma must be greater than 0.0");
-        return;
+// The pixels of the first plane of the mask above zero, as one byte per luma pixel that is also cleared outside roi
+static void findInside(const VSFrameRef * mask, uint8_t * VS_RESTRICT inside, const TCannyData * d, const VSAPI * vsapi) {
+    const VSFormat * format = vsapi->getFrameFormat(mask);
+    const uint8_t * srcp = vsapi->getReadPtr(mask, 0);
+    const int stride = vsapi->getStride(mask, 0);
+
+    memset(inside, 0, static_cast<size_t>(d->vi->width) * d->vi->height);
+    if (format->sampleType == stInteger && format->bitsPerSample == 8)
+        insideRows<uint8_t>(srcp, inside, stride, d);
+    else if (format->sampleType == stInteger)
+        insideRows<uint16_t>(srcp, inside, stride, d);
+    else if (format->bitsPerSample == 16)
+        insideRows<Half>(srcp, inside, stride, d);
+    else
+        insideRows<float>(srcp, inside, stride, d);
+}
+
+// The span from the first to the last selected pixel of each row of a plane
+static void findSpans(std::vector<std::pair<int, int>> & spans, const uint8_t * inside, const int width, const int height, const int plane,
+                      const TCannyData * d) {
+    const int ssW = plane ? d->vi->format->subSamplingW : 0;
+    const int ssH = plane ? d->vi->format->subSamplingH : 0;
+    const int x0 = d->roi[0] >> ssW, x1 = (d->roi[2] + (1 << ssW) - 1) >> ssW;
+    const int y0 = d->roi[1] >> ssH, y1 = (d->roi[3] + (1 << ssH) - 1) >> ssH;
+
+    spans.assign(height, { 0, 0 });
+    for (int y = y0; y < y1; y++) {
+        if (!inside) {
+            spans[y] = { x0, x1 };
+            continue;
+        }
+        const uint8_t * row = inside + (y << ssH) * d->vi->width;
+        int first = x0, last = x1;
+        while (first < last && !row[first << ssW])
+            first++;
+        while (last > first && !row[(last - 1) << ssW])
+            last--;
+        spans[y] = { first, last };
     }
-    if (d.nms < 0 || d.nms > 3) {
-        vsapi->setError(out, "TCanny: nms must be set to 0, 1, 2 or 3");
-        return;
+}
+
+// Rectangles around the pixels that roi and mask select, grown by the reach of the kernels
+static const int regionTileHeight = 32;
+
+static void regionRects(std::vector<Rect> & rects, const std::vector<std::pair<int, int>> & spans, const int width, const int height, const int margin,
+                        const int shift) {
+    const int coarseWidth = (width + (1 << shift) - 1) >> shift;
+    const int coarseHeight = (height + (1 << shift) - 1) >> shift;
+
+    rects.clear();
+    for (int t0 = 0; t0 < height; t0 += regionTileHeight) {
+        Rect tile = { width, height, 0, 0 };
+        for (int y = t0; y < std::min(t0 + regionTileHeight, height); y++) {
+            if (spans[y].first < spans[y].second) {
+                tile.x0 = std::min(tile.x0, spans[y].first);
+                tile.x1 = std::max(tile.x1, spans[y].second);
+                tile.y0 = std::min(tile.y0, y);
+                tile.y1 = y + 1;
+            }
+        }
+        if (tile.x0 >= tile.x1)
+            continue;
+
+        const Rect rect = { std::max((tile.x0 >> shift) - margin, 0), std::max((tile.y0 >> shift) - margin, 0),
+                            std::min(((tile.x1 - 1) >> shift) + 1 + margin, coarseWidth), std::min(((tile.y1 - 1) >> shift) + 1 + margin, coarseHeight) };
+        if (!rects.empty() && rects.back().y1 > rect.y0) {
+            Rect & last = rects.back();
+            last.x0 = std::min(last.x0, rect.x0);
+            last.x1 = std::max(last.x1, rect.x1);
+            last.y1 = rect.y1;
+        } else {
+            rects.push_back(rect);
+        }
     }
-    if (d.mode < -1 || d.mode > 3) {
-        vsapi->setError(out, "TCanny: mode must be set to -1, 0, 1, 2 or 3");
-        return;
+}
+
+// Rows [y0, y1) of an output outside the selected pixels get `value`, what an output holds where there is no edge and no gradient
+template<typename T>
+static void fillOutside(T * VS_RESTRICT dstp, const int width, const int y0, const int y1, const int stride, const T value,
+                        const std::vector<std::pair<int, int>> & spans, const uint8_t * inside, const int plane, const TCannyData * d) {
+    const int ssW = plane ? d->vi->format->subSamplingW : 0;
+    const int ssH = plane ? d->vi->format->subSamplingH : 0;
+
+    for (int y = y0; y < y1; y++) {
+        T * row = dstp + y * stride;
+        const int x0 = spans[y].first, x1 = spans[y].second;
+        std::fill(row, row + x0, value);
+        std::fill(row + x1, row + width, value);
+        if (inside) {
+            const uint8_t * selectedRow = inside + (y << ssH) * d->vi->width;
+            for (int x = x0; x < x1; x++) {
+                if (!selectedRow[x << ssW])
+                    row[x] = value;
+            }
+        }
+    }
+}
+
+// Marks the pixels that roi and mask select in the plane the pipeline runs on, for stats
+static void selectPixels(uint8_t * VS_RESTRICT selected, const std::vector<std::pair<int, int>> & spans, const uint8_t * inside, const int height,
+                         const int stride, const int shift, const int plane, const TCannyData * d) {
+    const int ssW = plane ? d->vi->format->subSamplingW : 0;
+    const int ssH = plane ? d->vi->format->subSamplingH : 0;
+
+    memset(selected, 0, static_cast<size_t>(stride) * ((height + (1 << shift) - 1) >> shift));
+    for (int y = 0; y < height; y++) {
+        uint8_t * row = selected + (y >> shift) * stride;
+        const uint8_t * insideRow = inside ? inside + (y << ssH) * d->vi->width : nullptr;
+        for (int x = spans[y].first; x < spans[y].second; x++) {
+            if (!insideRow || insideRow[x << ssW])
+                row[x >> shift] = 1;
+        }
+    }
+}
+
+// scale: the decimated plane, each pixel the average of its block of source pixels
+template<typename T>
+static void decimateRows(const T * srcp, T * VS_RESTRICT dstp, float * VS_RESTRICT sums, const int width, const int height, const int srcStride,
+                         const int dstStride, const int x0, const int x1, const int y0, const int y1, const int shift) {
+    const int size = 1 << shift;
+    const int left = x0 << shift, right = std::min(x1 << shift, width);
+
+    for (int y = y0; y < y1; y++) {
+        const int top = y << shift, rows = std::min(size, height - top);
+        std::fill(sums + x0, sums + x1, 0.f);
+        for (int r = 0; r < rows; r++) {
+            const T * row = srcp + (top + r) * srcStride;
+            for (int x = left; x < right; x++)
+                sums[x >> shift] += row[x];
+        }
+        for (int x = x0; x < x1; x++) {
+            const float average = sums[x] / (rows * (std::min((x + 1) << shift, width) - (x << shift)));
+            dstp[y * dstStride + x] = static_cast<T>(std::is_integral<T>::value ? average + 0.5f : average);
+        }
+    }
+}
+
+// scale: a full size output, each pixel taken from the decimated pixel of its block
+template<typename T>
+static void upsampleRows(const T * srcp, T * VS_RESTRICT dstp, const int srcStride, const int dstStride, const int x0, const int x1,
+                         const int y0, const int y1, const int shift) {
+    for (int y = y0; y < y1; y++) {
+        const T * row = srcp + (y >> shift) * srcStride;
+        T * out = dstp + y * dstStride;
+        for (int x = x0; x < x1; x++)
+            out[x] = row[x >> shift];
+    }
+}
+
+// Planes are split into at most d->threads bands of at least minBandHeight rows for the row sweep and the output conversion
+static const int minBandHeight = 16;
+
+template<typename T, typename B>
+static bool TCanny(const VSFrameRef * src, VSFrameRef * const * dst, Scratch * scratch, PlaneStats * stats, EdgeStats * edgeStats, TCannyData * d,
+                   const VSAPI * vsapi) {
+    int planes[3], count = 0;
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        if (d->process[plane])
+            planes[count++] = plane;
+    }
+
+    // The ring buffers are sized for the widest plane so that one buffer per thread serves every plane
+    const int rowStride = vsapi->getStride(src, 0) / sizeof(T);
+    std::atomic<bool> ok(true);
+
+    const auto processPlane = [&](const int index) {
+        const int plane = planes[index];
+        const int planeWidth = vsapi->getFrameWidth(src, plane);
+        const int planeHeight = vsapi->getFrameHeight(src, plane);
+        const int shift = d->scaleShift;
+        const float offset = (d->vi->format->sampleType == stInteger || plane == 0 || d->vi->format->colorFamily == cmRGB) ? 0.f : 0.5f;
+        const int set = d->concurrentPlanes ? plane : 0;
+        float ** fa = scratch->fa[set];
+        PlaneStats * planeStats = stats ? stats + plane : nullptr;
+        EdgeStats * planeEdges = edgeStats ? edgeStats + plane : nullptr;
+        std::atomic<int64_t> * times = stats ? stats[plane].time : nullptr;
+
+        // With scale the pipeline reads the decimated plane and writes its outputs next to it, to be upsampled afterwards
+        const int stride = shift ? d->coarseStride : vsapi->getStride(src, plane) / sizeof(T);
+        const T * planeSrcp = shift ? reinterpret_cast<const T *>(scratch->coarse[set][0]) : reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
+        uint8_t * planeDstp[4];
+        int dstStride[4];
+        for (int k = 0; k < d->outputs; k++) {
+            planeDstp[k] = shift ? scratch->coarse[set][k + 1] : vsapi->getWritePtr(dst[k], plane);
+            dstStride[k] = shift ? stride * d->formats[k]->bytesPerSample : vsapi->getStride(dst[k], plane);
+        }
+
+        // Each rectangle runs through the pipeline as a plane of its own, in the scratch buffers from their first row and column
+        const auto processRect = [&](const Rect & rect) {
+            const int width = rect.x1 - rect.x0;
+            const int height = rect.y1 - rect.y0;
+            const T * srcp = planeSrcp + rect.y0 * stride + rect.x0;
+            const int bands = std::max(std::min(d->threads, height / minBandHeight), 1);
+            const uint8_t * selected = (planeEdges && d->region) ? scratch->selected[set] + rect.y0 * stride + rect.x0 : nullptr;
+            const auto writePtr = [&](const int k) {
+                return planeDstp[k] + rect.y0 * dstStride[k] + rect.x0 * d->formats[k]->bytesPerSample;
+            };
+
+            if (d->wantBlur && d->opt != 1 && d->blur != 2) {
+                T * dstp = reinterpret_cast<T *>(writePtr(0));
+                parallelFor(d, bands, [&](const int i) {
+                    float * rows = acquireRows(d, rowStride);
+                    if (!rows) {
+                        ok = false;
+                        return;
+                    }
+                    StageTimer timer(times);
+                    blurBand<T, B>(srcp, dstp, rows, width, height, stride, height * i / bands, height * (i + 1) / bands, plane, offset, d, timer);
+                    releaseRows(d, rows);
+                });
+                return;
+            }
+
+            T * dstp[4];
+            for (int k = 0; k < d->outputs; k++)
+                dstp[k] = reinterpret_cast<T *>(writePtr(k));
+            float * blurred = nullptr;
+            SweepTargets targets = {};
+
+            try {
+                if (d->opt == 1) {
+                    StageTimer timer(times);
+                    if (d->derivative) {
+                        derivativeImages<T>(srcp, fa[1], fa[0], fa[2], width, height, stride, offset, d, timer);
+                    } else if (d->blur == 2) {
+                        iirVertical<T>(srcp, fa[0], 0, width, height, stride, d->iir, offset);
+                        timer.lap(debugBlurV);
+                        iirHorizontal(fa[0], width, 0, height, stride, d->iir);
+                    } else {
+                        genConvV<T>(srcp, fa[1], width, height, stride, d->grad, d->weights, offset);
+                        timer.lap(debugBlurV);
+                        genConvH(fa[1], fa[0], width, height, stride, d->grad, d->weights);
+                    }
+                    timer.lap(debugBlurH);
+
+                    if (!d->wantBlur)
+                        d->gmDirImages(fa[0], fa[1], fa[2], width, height, stride, d, planeEdges, selected, timer);
+                    if (d->wantEdges) {
+                        hystersis(fa[0], scratch->stack, width, height, stride, d->t_h, d->t_l, planeStats, planeEdges, selected);
+                        timer.lap(debugHysteresis);
+                    }
+                } else {
+                    if (d->blur == 2) {
+                        blurred = scratch->blurred[set];
+                        parallelFor(d, (width + iirColumns - 1) / iirColumns, [&](const int i) {
+                            StageTimer timer(times);
+                            iirVertical<T>(srcp, blurred, i * iirColumns, std::min((i + 1) * iirColumns, width), height, stride, d->iir, offset);
+                            timer.lap(debugBlurV);
+                        });
+                        parallelFor(d, (height + iirBandHeight - 1) / iirBandHeight, [&](const int i) {
+                            StageTimer timer(times);
+                            iirHorizontal(blurred, width, i * iirBandHeight, std::min((i + 1) * iirBandHeight, height), stride, d->iir);
+                            timer.lap(debugBlurH);
+                        });
+                    }
+
+                    // The recursive blur is already mode -1; the sweep writes the other modes straight into the output frames
+                    if (!d->wantBlur) {
+                        targets.edges = d->wantEdges ? scratch->edges[set] : nullptr;
+                        targets.selected = selected;
+                        for (int k = 0; k < d->outputs; k++) {
+                            if (d->modes[k] == 1)
+                                targets.magnitude = dstp[k];
+                            else if (d->modes[k] == 3 || (d->modes[k] == 2 && !targets.direction))
+                                targets.direction = dstp[k];
+                        }
+                        // Each band gathers the statistics of its own rows, which are added up once the bands are done
+                        std::vector<EdgeStats> bandStats(planeEdges ? bands : 0);
+                        parallelFor(d, bands, [&](const int i) {
+                            float * rows = acquireRows(d, rowStride);
+                            if (!rows) {
+                                ok = false;
+                                return;
+                            }
+                            StageTimer timer(times);
+                            SweepTargets band = targets;
+                            band.stats = planeEdges ? &bandStats[i] : nullptr;
+                            d->sweep(srcp, band, blurred, rows, width, height, stride, height * i / bands, height * (i + 1) / bands, plane, d, offset, timer);
+                            releaseRows(d, rows);
+                        });
+                        if (!ok)
+                            return;
+                        for (const EdgeStats & band : bandStats)
+                            addStats(*planeEdges, band);
+
+                        if (d->wantEdges)
+                            hysteresisBands(targets.edges, scratch->runs[plane], scratch->rowStart[plane], width, height, stride, d, planeStats, planeEdges, selected);
+                    }
+                }
+            } catch (const std::bad_alloc &) {
+                ok = false;
+                return;
+            }
+
+            parallelFor(d, bands, [&](const int i) {
+                StageTimer timer(times);
+                const int y0 = height * i / bands;
+                const int rows = height * (i + 1) / bands - y0;
+                float * fr[3];
+                for (int k = 0; k < 3; k++)
+                    fr[k] = fa[k] ? fa[k] + y0 * stride : nullptr;
+                for (int k = 0; k < d->outputs; k++) {
+                    if (d->formats[k] != d->vi->format)
+                        outputMaskRows(fa[0], targets.edges, reinterpret_cast<uint8_t *>(dstp[k]), width, y0, rows, stride, dstStride[k], d);
+                    else if (d->opt == 1)
+                        outputRows<T>(fr, dstp[k] + y0 * stride, width, rows, stride, plane, offset, d->modes[k], d);
+                    else
+                        outputSweepRows<T>(targets, blurred, dstp[k], width, y0, rows, stride, plane, offset, d->modes[k], d);
+                }
+                timer.lap(debugOutput);
+            });
+        };
+
+        // The decimated block rows of a rectangle, and the output rows they cover
+        const auto decimate = [&](const Rect & rect) {
+            const T * srcp = reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
+            const int srcStride = vsapi->getStride(src, plane) / sizeof(T);
+            const int bands = std::max(std::min(d->threads, (rect.y1 - rect.y0) / minBandHeight), 1);
+            parallelFor(d, bands, [&](const int i) {
+                float * sums = acquireRows(d, rowStride);
+                if (!sums) {
+                    ok = false;
+                    return;
+                }
+                StageTimer timer(times);
+                decimateRows<T>(srcp, reinterpret_cast<T *>(scratch->coarse[set][0]), sums, planeWidth, planeHeight, srcStride, stride, rect.x0, rect.x1,
+                                rect.y0 + (rect.y1 - rect.y0) * i / bands, rect.y0 + (rect.y1 - rect.y0) * (i + 1) / bands, shift);
+                releaseRows(d, sums);
+                timer.lap(debugBlurV);
+            });
+        };
+        const auto upsample = [&](const Rect & rect) {
+            const int x0 = rect.x0 << shift, x1 = std::min(rect.x1 << shift, planeWidth);
+            const int y0 = rect.y0 << shift, y1 = std::min(rect.y1 << shift, planeHeight);
+            const int bands = std::max(std::min(d->threads, (y1 - y0) / minBandHeight), 1);
+            parallelFor(d, bands, [&](const int i) {
+                StageTimer timer(times);
+                for (int k = 0; k < d->outputs; k++) {
+                    const int bytes = d->formats[k]->bytesPerSample;
+                    uint8_t * dstp = vsapi->getWritePtr(dst[k], plane);
+                    const int outStride = vsapi->getStride(dst[k], plane) / bytes;
+                    if (d->formats[k] != d->vi->format)
+                        upsampleRows<uint8_t>(planeDstp[k], dstp, stride, outStride, x0, x1, y0 + (y1 - y0) * i / bands, y0 + (y1 - y0) * (i + 1) / bands, shift);
+                    else
+                        upsampleRows<T>(reinterpret_cast<const T *>(planeDstp[k]), reinterpret_cast<T *>(dstp), stride, outStride, x0, x1,
+                                        y0 + (y1 - y0) * i / bands, y0 + (y1 - y0) * (i + 1) / bands, shift);
+                }
+                timer.lap(debugOutput);
+            });
+        };
+
+        if (!d->region && !shift) {
+            processRect({ 0, 0, planeWidth, planeHeight });
+            return;
+        }
+
+        const uint8_t * inside = d->mask ? scratch->inside : nullptr;
+        std::vector<std::pair<int, int>> & spans = scratch->spans[set];
+        std::vector<Rect> & rects = scratch->rects[set];
+        if (d->region) {
+            findSpans(spans, inside, planeWidth, planeHeight, plane, d);
+            regionRects(rects, spans, planeWidth, planeHeight, d->grad + 2, shift);
+            if (planeEdges)
+                selectPixels(scratch->selected[set], spans, inside, planeHeight, stride, shift, plane, d);
+        } else {
+            rects.assign(1, { 0, 0, (planeWidth + (1 << shift) - 1) >> shift, (planeHeight + (1 << shift) - 1) >> shift });
+        }
+        for (const Rect & rect : rects) {
+            if (shift)
+                decimate(rect);
+            if (ok)
+                processRect(rect);
+            if (!ok)
+                return;
+            if (shift)
+                upsample(rect);
+        }
+        if (!d->region)
+            return;
+
+        const int bands = std::max(std::min(d->threads, planeHeight / minBandHeight), 1);
+        parallelFor(d, bands, [&](const int i) {
+            StageTimer timer(times);
+            const int y0 = planeHeight * i / bands;
+            const int y1 = planeHeight * (i + 1) / bands;
+            for (int k = 0; k < d->outputs; k++) {
+                uint8_t * dstp = vsapi->getWritePtr(dst[k], plane);
+                if (d->formats[k] != d->vi->format)
+                    fillOutside<uint8_t>(dstp, planeWidth, y0, y1, vsapi->getStride(dst[k], plane), 0, spans, inside, plane, d);
+                else
+                    fillOutside<T>(reinterpret_cast<T *>(dstp), planeWidth, y0, y1, vsapi->getStride(dst[k], plane) / sizeof(T), static_cast<T>(d->vi->format->sampleType == stFloat ? d->lower[plane] : 0.f),
+                                   spans, inside, plane, d);
+            }
+            timer.lap(debugOutput);
+        });
+    };
+
+    if (d->concurrentPlanes) {
+        parallelFor(d, count, processPlane);
+    } else {
+        for (int i = 0; i < count && ok; i++)
+            processPlane(i);
+    }
+    return ok;
+}
+
+static void freeScratch(Scratch & scratch) {
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 3; k++)
+            vs_aligned_free(scratch.fa[i][k]);
+        vs_aligned_free(scratch.blurred[i]);
+        vs_aligned_free(scratch.edges[i]);
+        vs_aligned_free(scratch.selected[i]);
+    }
+    vs_aligned_free(scratch.stack.map);
+    vs_aligned_free(scratch.stack.pos);
+    vs_aligned_free(scratch.inside);
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 5; k++)
+            vs_aligned_free(scratch.coarse[i][k]);
+    }
+}
+
+// The working set for one frame, reused from a frame that is done or allocated if every one is in use; null if the allocation fails
+static Scratch * acquireScratch(TCannyData * d, const int stride) {
+    std::lock_guard<std::mutex> lock(d->scratchMutex);
+
+    if (!d->idleScratch.empty()) {
+        Scratch * scratch = d->idleScratch.back();
+        d->idleScratch.pop_back();
+        return scratch;
+    }
+
+    Scratch scratch = {};
+    // With scale every stage works on the decimated planes
+    const int coarseHeight = (d->vi->height + (1 << d->scaleShift) - 1) >> d->scaleShift;
+    const size_t pixels = d->scaleShift ? static_cast<size_t>(d->coarseStride) * coarseHeight : static_cast<size_t>(stride) * d->vi->height;
+    size_t bytes = 0;
+    bool failed = false;
+
+    const auto allocate = [&](const size_t size) {
+        void * buffer = vs_aligned_malloc<void>(size, 32);
+        failed |= !buffer;
+        bytes += size;
+        return buffer;
+    };
+
+    // opt=1 works on whole float planes, the fused pipeline only on the edge classes and the recursively blurred plane
+    const int sets = d->concurrentPlanes ? d->vi->format->numPlanes : 1;
+    for (int set = 0; set < sets; set++) {
+        if (d->concurrentPlanes && !d->process[set])
+            continue;
+        if (d->opt == 1) {
+            for (int i = 0; i < 3; i++)
+                scratch.fa[set][i] = static_cast<float *>(allocate(pixels * sizeof(float)));
+        } else {
+            if (d->blur == 2)
+                scratch.blurred[set] = static_cast<float *>(allocate(pixels * sizeof(float)));
+            if (d->wantEdges)
+                scratch.edges[set] = static_cast<uint8_t *>(allocate(pixels));
+        }
+        if (d->stats && d->region)
+            scratch.selected[set] = static_cast<uint8_t *>(allocate(pixels));
+        if (d->scaleShift) {
+            scratch.coarse[set][0] = static_cast<uint8_t *>(allocate(pixels * d->vi->format->bytesPerSample));
+            for (int k = 0; k < d->outputs; k++)
+                scratch.coarse[set][k + 1] = static_cast<uint8_t *>(allocate(pixels * d->formats[k]->bytesPerSample));
+        }
+    }
+
+    if (d->wantEdges && d->opt == 1) {
+        const size_t size = static_cast<size_t>(d->vi->width) * d->vi->height;
+        scratch.stack.map = static_cast<uint8_t *>(allocate(size));
+        scratch.stack.pos = static_cast<std::pair<int, int> *>(allocate(size * sizeof(std::pair<int, int>)));
+    }
+
+    if (d->mask)
+        scratch.inside = static_cast<uint8_t *>(allocate(static_cast<size_t>(d->vi->width) * d->vi->height));
+
+    if (failed) {
+        freeScratch(scratch);
+        return nullptr;
+    }
+
+    d->scratchBytes += bytes;
+    d->scratch.push_back(new Scratch(scratch));
+    return d->scratch.back();
+}
+
+static void releaseScratch(TCannyData * d, Scratch * scratch) {
+    std::lock_guard<std::mutex> lock(d->scratchMutex);
+    d->idleScratch.push_back(scratch);
+}
+
+// One element per plane of the format, zero for planes that are not processed; times are in milliseconds
+static void setDebugProps(VSMap * props, const PlaneStats * stats, const TCannyData * d, const VSAPI * vsapi) {
+    static const char * const timeNames[debugStages] = {
+        "TCannyTimeBlurV", "TCannyTimeBlurH", "TCannyTimeGradient", "TCannyTimeNMS", "TCannyTimeHysteresis", "TCannyTimeOutput"
+    };
+
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        const int append = plane ? paAppend : paReplace;
+        for (int i = 0; i < debugStages; i++)
+            vsapi->propSetFloat(props, timeNames[i], stats[plane].time[i] / 1e6, append);
+        vsapi->propSetInt(props, "TCannyHysteresisSeeds", stats[plane].seeds, append);
+        vsapi->propSetInt(props, "TCannyHysteresisVisited", stats[plane].visited, append);
+        vsapi->propSetInt(props, "TCannyHysteresisDepth", stats[plane].depth, append);
+        vsapi->propSetInt(props, "TCannyHysteresisRuns", stats[plane].runs, append);
+    }
+    vsapi->propSetInt(props, "TCannyScratchBytes", d->scratchBytes, paReplace);
+}
+
+// One element per plane, and statsBins per plane for the histogram; the gradient is in the 8-bit units of t_h
+static const char * const statsNames[] = { "TCannyEdgeCount", "TCannyEdgeDensity", "TCannyGradientMean", "TCannyGradientMax", "TCannyGradientHistogram" };
+
+static void setStatsProps(VSMap * props, const EdgeStats * stats, const TCannyData * d, const VSAPI * vsapi) {
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        const int append = plane ? paAppend : paReplace;
+        const EdgeStats & s = stats[plane];
+        const double pixels = static_cast<double>(std::max<int64_t>(s.pixels, 1));
+        vsapi->propSetInt(props, statsNames[0], s.edges, append);
+        vsapi->propSetFloat(props, statsNames[1], s.edges / pixels, append);
+        vsapi->propSetFloat(props, statsNames[2], s.sum / pixels / d->statsUnit, append);
+        vsapi->propSetFloat(props, statsNames[3], s.max / d->statsUnit, append);
+        for (int i = 0; i < statsBins; i++)
+            vsapi->propSetFloat(props, statsNames[4], s.histogram[i] / pixels, (plane || i) ? paAppend : paReplace);
+    }
+}
+
+// A cache hit takes its frame properties from the current source frame, so the statistics of the cached result are carried over
+static void copyStatsProps(const VSMap * from, VSMap * to, const VSAPI * vsapi) {
+    for (int i = 0; i < vsapi->propNumElements(from, statsNames[0]); i++)
+        vsapi->propSetInt(to, statsNames[0], vsapi->propGetInt(from, statsNames[0], i, nullptr), i ? paAppend : paReplace);
+    for (const char * name : { statsNames[1], statsNames[2], statsNames[3], statsNames[4] }) {
+        for (int i = 0; i < vsapi->propNumElements(from, name); i++)
+            vsapi->propSetFloat(to, name, vsapi->propGetFloat(from, name, i, nullptr), i ? paAppend : paReplace);
+    }
+}
+
+// One blur and gradient pass produces every plane that the requested outputs read
+static void planStages(TCannyData * d) {
+    for (int i = 0; i < d->outputs; i++) {
+        d->wantBlur |= d->modes[i] == -1;
+        d->wantEdges |= d->modes[i] == 0 || d->modes[i] == 2 || d->stats;
+        d->wantMagnitude |= d->modes[i] == 1;
+        d->wantDirection |= d->modes[i] >= 2;
+    }
+}
+
+template<typename T, typename B, int op>
+static SweepFunc selectSweep(const int nms) {
+    if (nms == 0)
+        return fusedBand<T, B, op, 0>;
+    else if (nms == 1)
+        return fusedBand<T, B, op, 1>;
+    else if (nms == 2)
+        return fusedBand<T, B, op, 2>;
+    return fusedBand<T, B, op, 3>;
+}
+
+template<typename T, typename B>
+static SweepFunc selectSweep(const int op, const int nms) {
+    if (op == 0)
+        return selectSweep<T, B, 0>(nms);
+    else if (op == 1)
+        return selectSweep<T, B, 1>(nms);
+    else if (op == 2)
+        return selectSweep<T, B, 2>(nms);
+    return selectSweep<T, B, 3>(nms);
+}
+
+// nms only matters when the gradient is suppressed, so the other modes share the nms=0 instance
+template<int op>
+static GMDirFunc selectGMDir(const int nms, const int mode) {
+    if (mode == 1)
+        return gmDirImages<op, 0, 1>;
+    else if (mode == 3)
+        return gmDirImages<op, 0, 3>;
+    else if (nms == 0)
+        return gmDirImages<op, 0, 0>;
+    else if (nms == 1)
+        return gmDirImages<op, 1, 0>;
+    else if (nms == 2)
+        return gmDirImages<op, 2, 0>;
+    return gmDirImages<op, 3, 0>;
+}
+
+// Picks the kernel instances for the sample type, op, nms and output modes once per filter instance, so that none of them is tested per pixel
+static void selectKernels(TCannyData * d) {
+    if (d->vi->format->sampleType == stFloat)
+        d->sweep = (d->vi->format->bitsPerSample == 16) ? selectSweep<Half, float>(d->op, d->nms) : selectSweep<float, float>(d->op, d->nms);
+    else if (d->vi->format->bitsPerSample == 8)
+        d->sweep = d->fixed ? selectSweep<uint8_t, int16_t>(d->op, d->nms) : selectSweep<uint8_t, float>(d->op, d->nms);
+    else
+        d->sweep = d->fixed ? selectSweep<uint16_t, int16_t>(d->op, d->nms) : selectSweep<uint16_t, float>(d->op, d->nms);
+
+    // gmDirImages only needs to know whether to suppress and whether to keep the direction
+    const int mode = d->wantEdges ? 0 : (d->wantDirection ? 3 : 1);
+    if (d->op == 0)
+        d->gmDirImages = selectGMDir<0>(d->nms, mode);
+    else if (d->op == 1)
+        d->gmDirImages = selectGMDir<1>(d->nms, mode);
+    else if (d->op == 2)
+        d->gmDirImages = selectGMDir<2>(d->nms, mode);
+    else
+        d->gmDirImages = selectGMDir<3>(d->nms, mode);
+}
+
+static void VS_CC tcannyInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    TCannyData * d = static_cast<TCannyData *>(*instanceData);
+    VSVideoInfo vi[] = { *d->vi, *d->vi, *d->vi, *d->vi };
+    for (int k = 0; k < d->outputs; k++)
+        vi[k].format = d->formats[k];
+    vsapi->setVideoInfo(vi, d->outputs, node);
+}
+
+std::deque<PendingFrame>::iterator findPending(TCannyData * d, const int n) {
+    return std::find_if(d->pending.begin(), d->pending.end(), [n](const PendingFrame & entry) { return entry.n == n; });
+}
+
+// Takes frame n of `output` if another output has computed it; with `claim` the caller computes it otherwise
+VSFrameRef * takePending(TCannyData * d, const int n, const int output, const bool claim) {
+    std::lock_guard<std::mutex> lock(d->pendingMutex);
+
+    d->requested[output] = true;
+    const auto it = findPending(d, n);
+    if (it != d->pending.end() && it->frame[output]) {
+        VSFrameRef * frame = it->frame[output];
+        it->frame[output] = nullptr;
+        it->served[output] = true;
+        return frame;
+    }
+
+    if (claim && it != d->pending.end()) {
+        it->computing++;
+    } else if (claim) {
+        PendingFrame entry = { n, 1, {}, {} };
+        d->pending.push_back(entry);
+    }
+    return nullptr;
+}
+
+// Ends the computation that takePending claimed, keeping frame n for the outputs that have not had it
+void putPending(TCannyData * d, const int n, VSFrameRef * const * dst, const int output, const bool served, const VSAPI * vsapi) {
+    std::lock_guard<std::mutex> lock(d->pendingMutex);
+
+    const auto it = findPending(d, n);
+    it->computing--;
+    if (served) {
+        it->served[output] = true;
+        vsapi->freeFrame(it->frame[output]);
+        it->frame[output] = nullptr;
+    }
+    for (int k = 0; k < d->outputs && dst; k++) {
+        if (k == output)
+            continue;
+        if (d->requested[k] && !it->served[k] && !it->frame[k])
+            it->frame[k] = dst[k];
+        else
+            vsapi->freeFrame(dst[k]);
     }
-    if (d.op < 0 || d.op > 2) {
-        vsapi->setError(out, "TCanny: op must be set to 0, 1 or 2");
+
+    for (auto old = d->pending.begin(); d->pending.size() > d->pendingLimit && old != d->pending.end();) {
+        if (old->computing) {
+            ++old;
+            continue;
+        }
+        for (int k = 0; k < d->outputs; k++)
+            vsapi->freeFrame(old->frame[k]);
+        old = d->pending.erase(old);
+    }
+}
+
+// Fingerprint of the processed planes of a frame for the result cache; hits are confirmed by sameFrame
+uint64_t hashFrame(const VSFrameRef * frame, const TCannyData * d, const VSAPI * vsapi) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t lane[4] = { 1, 2, 3, 4 };
+
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+        const int rowBytes = vsapi->getFrameWidth(frame, plane) * d->vi->format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        const uint8_t * srcp = vsapi->getReadPtr(frame, plane);
+        for (int y = 0; y < height; y++) {
+            const uint8_t * row = srcp + y * stride;
+            int x = 0;
+            for (; x + 32 <= rowBytes; x += 32) {
+                for (int i = 0; i < 4; i++) {
+                    uint64_t v;
+                    memcpy(&v, row + x + i * 8, sizeof(v));
+                    lane[i] = (lane[i] ^ v) * prime;
+                    lane[i] ^= lane[i] >> 32;
+                }
+            }
+            for (; x < rowBytes; x++)
+                lane[0] = (lane[0] ^ row[x]) * prime;
+        }
+    }
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ lane[i]) * prime;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static bool sameFrame(const VSFrameRef * a, const VSFrameRef * b, const TCannyData * d, const VSAPI * vsapi) {
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+        const int rowBytes = vsapi->getFrameWidth(a, plane) * d->vi->format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(a, plane);
+        const int strideA = vsapi->getStride(a, plane), strideB = vsapi->getStride(b, plane);
+        const uint8_t * srcpA = vsapi->getReadPtr(a, plane), * srcpB = vsapi->getReadPtr(b, plane);
+        if (srcpA == srcpB)
+            continue;
+        for (int y = 0; y < height; y++) {
+            if (memcmp(srcpA + y * strideA, srcpB + y * strideB, rowBytes))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The cached result of `output` for a source with the same processed planes as `src`, or null
+const VSFrameRef * lookupCache(TCannyData * d, const uint64_t hash, const VSFrameRef * src, const int output, const VSAPI * vsapi) {
+    struct Candidate {
+        uint64_t id;
+        const VSFrameRef * src, * dst;
+    };
+    std::vector<Candidate> candidates;
+    {
+        std::lock_guard<std::mutex> lock(d->cacheMutex);
+
+        d->cacheLookups++;
+        for (const CacheEntry & entry : d->cache) {
+            if (entry.hash == hash)
+                candidates.push_back({ entry.id, vsapi->cloneFrameRef(entry.src), vsapi->cloneFrameRef(entry.dst[output]) });
+        }
+    }
+
+    const VSFrameRef * result = nullptr;
+    for (const Candidate & candidate : candidates) {
+        if (!result && sameFrame(candidate.src, src, d, vsapi)) {
+            std::lock_guard<std::mutex> lock(d->cacheMutex);
+
+            const auto it = std::find_if(d->cache.begin(), d->cache.end(), [&](const CacheEntry & entry) { return entry.id == candidate.id; });
+            if (it != d->cache.end())
+                d->cache.splice(d->cache.begin(), d->cache, it);
+            d->cacheHits++;
+            result = candidate.dst;
+        } else {
+            vsapi->freeFrame(candidate.dst);
+        }
+        vsapi->freeFrame(candidate.src);
+    }
+    return result;
+}
+
+// Keeps a source frame and its results once, dropping the least recently used entries beyond cacheSize
+void putCache(TCannyData * d, const uint64_t hash, const VSFrameRef * src, VSFrameRef * const * dst, const VSAPI * vsapi) {
+    std::lock_guard<std::mutex> lock(d->cacheMutex);
+
+    const auto it = std::find_if(d->cache.begin(), d->cache.end(), [&](const CacheEntry & entry) {
+        return entry.hash == hash && sameFrame(entry.src, src, d, vsapi);
+    });
+    if (it != d->cache.end()) {
+        d->cache.splice(d->cache.begin(), d->cache, it);
         return;
     }
-    if (d.gmmax < 1.f) {
-        vsapi->setError(out, "TCanny: gmmax must be greater than or equal to 1.0");
+
+    CacheEntry entry = { d->cacheEntries++, hash, vsapi->cloneFrameRef(src), {} };
+    for (int k = 0; k < d->outputs; k++)
+        entry.dst[k] = vsapi->cloneFrameRef(dst[k]);
+    d->cache.push_front(entry);
+
+    while (d->cache.size() > static_cast<size_t>(d->cacheSize)) {
+        vsapi->freeFrame(d->cache.back().src);
+        for (int k = 0; k < d->outputs; k++)
+            vsapi->freeFrame(d->cache.back().dst[k]);
+        d->cache.pop_back();
+    }
+}
+
+// The planes of an 8-bit mask that are not processed hold no edges
+static void clearPlanes(VSFrameRef * dst, const TCannyData * d, const VSAPI * vsapi) {
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        if (!d->process[plane])
+            memset(vsapi->getWritePtr(dst, plane), 0, vsapi->getStride(dst, plane) * vsapi->getFrameHeight(dst, plane));
+    }
+}
+
+// A mask shorter than the clip keeps selecting with its last frame
+static int maskFrame(const int n, const TCannyData * d, const VSAPI * vsapi) {
+    const int frames = vsapi->getVideoInfo(d->mask)->numFrames;
+    return frames > 0 ? std::min(n, frames - 1) : n;
+}
+
+static const VSFrameRef *VS_CC tcannyGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    TCannyData * d = static_cast<TCannyData *>(*instanceData);
+    const int output = (d->outputs > 1) ? vsapi->getOutputIndex(frameCtx) : 0;
+
+    if (activationReason == arInitial) {
+        if (d->outputs > 1) {
+            VSFrameRef * frame = takePending(d, n, output, false);
+            if (frame)
+                return frame;
+        }
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+        if (d->mask)
+            vsapi->requestFrameFilter(maskFrame(n, d, vsapi), d->mask, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        // Another output may have computed this frame while the source was being fetched
+        if (d->outputs > 1) {
+            VSFrameRef * frame = takePending(d, n, output, true);
+            if (frame)
+                return frame;
+        }
+
+        const VSFrameRef * src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const int pl[] = { 0, 1, 2 };
+
+        // A hit takes the processed planes of the cached result and everything else, frame properties included, from this source frame
+        const uint64_t hash = d->cacheSize ? hashFrame(src, d, vsapi) : 0;
+        if (d->cacheSize) {
+            const VSFrameRef * cached = lookupCache(d, hash, src, output, vsapi);
+            if (cached) {
+                // The 8-bit mask of mask8 cannot take planes from the source, so all of its planes come from the cache
+                const bool own = d->formats[output] != d->vi->format;
+                const VSFrameRef * fr[] = { (d->process[0] || own) ? cached : src, (d->process[1] || own) ? cached : src, (d->process[2] || own) ? cached : src };
+                VSFrameRef * dst = vsapi->newVideoFrame2(d->formats[output], d->vi->width, d->vi->height, fr, pl, src, core);
+                if (d->stats)
+                    copyStatsProps(vsapi->getFramePropsRO(cached), vsapi->getFramePropsRW(dst), vsapi);
+                if (d->debug)
+                    vsapi->propSetInt(vsapi->getFramePropsRW(dst), "TCannyCacheHit", 1, paReplace);
+                vsapi->freeFrame(cached);
+                vsapi->freeFrame(src);
+                if (d->outputs > 1)
+                    putPending(d, n, nullptr, output, true, vsapi);
+                return dst;
+            }
+        }
+
+        const VSFrameRef * fr[] = { d->process[0] ? nullptr : src, d->process[1] ? nullptr : src, d->process[2] ? nullptr : src };
+        const VSFrameRef * none[] = { nullptr, nullptr, nullptr };
+        VSFrameRef * dst[4] = {};
+        for (int k = 0; k < d->outputs; k++) {
+            if (d->formats[k] == d->vi->format) {
+                dst[k] = vsapi->newVideoFrame2(d->formats[k], d->vi->width, d->vi->height, fr, pl, src, core);
+            } else {
+                dst[k] = vsapi->newVideoFrame2(d->formats[k], d->vi->width, d->vi->height, none, pl, src, core);
+                clearPlanes(dst[k], d, vsapi);
+            }
+        }
+
+        Scratch * scratch = acquireScratch(d, vsapi->getStride(src, 0) / d->vi->format->bytesPerSample);
+        if (!scratch) {
+            vsapi->setFilterError("TCanny: malloc failure (scratch)", frameCtx);
+            vsapi->freeFrame(src);
+            for (int k = 0; k < d->outputs; k++)
+                vsapi->freeFrame(dst[k]);
+            if (d->outputs > 1)
+                putPending(d, n, nullptr, output, false, vsapi);
+            return nullptr;
+        }
+
+        if (d->mask) {
+            const VSFrameRef * mask = vsapi->getFrameFilter(maskFrame(n, d, vsapi), d->mask, frameCtx);
+            findInside(mask, scratch->inside, d, vsapi);
+            vsapi->freeFrame(mask);
+        }
+
+        PlaneStats planeStats[3] = {};
+        PlaneStats * stats = d->debug ? planeStats : nullptr;
+        EdgeStats planeEdges[3] = {};
+        EdgeStats * edgeStats = d->stats ? planeEdges : nullptr;
+
+        bool ok;
+        if (d->vi->format->sampleType == stInteger) {
+            if (d->vi->format->bitsPerSample == 8) {
+                if (d->fixed)
+                    ok = TCanny<uint8_t, int16_t>(src, dst, scratch, stats, edgeStats, d, vsapi);
+                else
+                    ok = TCanny<uint8_t, float>(src, dst, scratch, stats, edgeStats, d, vsapi);
+            } else {
+                if (d->fixed)
+                    ok = TCanny<uint16_t, int16_t>(src, dst, scratch, stats, edgeStats, d, vsapi);
+                else
+                    ok = TCanny<uint16_t, float>(src, dst, scratch, stats, edgeStats, d, vsapi);
+            }
+        } else {
+            if (d->vi->format->bitsPerSample == 16)
+                ok = TCanny<Half, float>(src, dst, scratch, stats, edgeStats, d, vsapi);
+            else
+                ok = TCanny<float, float>(src, dst, scratch, stats, edgeStats, d, vsapi);
+        }
+        releaseScratch(d, scratch);
+
+        if (!ok) {
+            vsapi->setFilterError("TCanny: malloc failure (row buffers or hysteresis runs)", frameCtx);
+            vsapi->freeFrame(src);
+            for (int k = 0; k < d->outputs; k++)
+                vsapi->freeFrame(dst[k]);
+            if (d->outputs > 1)
+                putPending(d, n, nullptr, output, false, vsapi);
+            return nullptr;
+        }
+
+        if (stats) {
+            for (int k = 0; k < d->outputs; k++) {
+                setDebugProps(vsapi->getFramePropsRW(dst[k]), stats, d, vsapi);
+                if (d->cacheSize)
+                    vsapi->propSetInt(vsapi->getFramePropsRW(dst[k]), "TCannyCacheHit", 0, paReplace);
+            }
+        }
+
+        if (edgeStats) {
+            for (int k = 0; k < d->outputs; k++)
+                setStatsProps(vsapi->getFramePropsRW(dst[k]), edgeStats, d, vsapi);
+        }
+
+        if (d->cacheSize)
+            putCache(d, hash, src, dst, vsapi);
+        vsapi->freeFrame(src);
+        if (d->outputs > 1)
+            putPending(d, n, dst, output, true, vsapi);
+        return dst[output];
+    }
+
+    return nullptr;
+}
+
+static void VS_CC tcannyFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    TCannyData * d = static_cast<TCannyData *>(instanceData);
+
+    delete d->pool;
+
+    if (!d->scratch.empty()) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "TCanny: peak scratch memory %.2f MiB for %u frames and %u bands at once",
+                 d->scratchBytes / (1024. * 1024.), static_cast<unsigned>(d->scratch.size()), static_cast<unsigned>(d->rows.size()));
+        vsapi->logMessage(mtDebug, msg);
+    }
+    for (Scratch * scratch : d->scratch) {
+        freeScratch(*scratch);
+        delete scratch;
+    }
+    for (float * rows : d->rows)
+        vs_aligned_free(rows);
+    for (auto & pending : d->pending) {
+        for (int k = 0; k < d->outputs; k++)
+            vsapi->freeFrame(pending.frame[k]);
+    }
+
+    if (d->cacheLookups) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "TCanny: result cache hit %lld of %lld lookups (%.1f%%)",
+                 static_cast<long long>(d->cacheHits), static_cast<long long>(d->cacheLookups), 100. * d->cacheHits / d->cacheLookups);
+        vsapi->logMessage(mtDebug, msg);
+    }
+    for (auto & entry : d->cache) {
+        vsapi->freeFrame(entry.src);
+        for (int k = 0; k < d->outputs; k++)
+            vsapi->freeFrame(entry.dst[k]);
+    }
+
+    vsapi->freeNode(d->node);
+    vsapi->freeNode(d->mask);
+    vs_aligned_free(d->weights);
+    vs_aligned_free(d->weightsFixed);
+    vs_aligned_free(d->derivative);
+    delete d;
+}
+
+// Checks the arguments read into d and derives the rest of the instance; returns an error message, or null
+const char * initData(TCannyData * d, const int decimation, const bool fixedAuto) {
+    if (d->sigma <= 0.f)
+        return "TCanny: sigma must be greater than 0.0";
+    if (d->nms < 0 || d->nms > 3)
+        return "TCanny: nms must be set to 0, 1, 2 or 3";
+    for (int i = 0; i < d->outputs; i++) {
+        if (d->modes[i] < -1 || d->modes[i] > 3)
+            return "TCanny: mode must be set to -1, 0, 1, 2 or 3";
+        if (std::count(d->modes, d->modes + i, d->modes[i]))
+            return "TCanny: mode specified twice";
+        if (d->modes[i] == -1 && d->outputs > 1)
+            return "TCanny: mode -1 cannot be output together with other modes";
+        if (d->modes[i] == -1 && d->stats)
+            return "TCanny: stats requires a mode other than -1, which computes no gradient";
+    }
+    planStages(d);
+    if (d->mask8 && !std::count(d->modes, d->modes + d->outputs, 0))
+        return "TCanny: mask8 requires mode 0";
+    if (d->op < 0 || d->op > 3)
+        return "TCanny: op must be set to 0, 1, 2 or 3";
+    if (d->gmmax < 1.f)
+        return "TCanny: gmmax must be greater than or equal to 1.0";
+    if (d->blur < 0 || d->blur > 2)
+        return "TCanny: blur must be set to 0, 1 or 2";
+    if (decimation != 1 && decimation != 2 && decimation != 4)
+        return "TCanny: scale must be set to 1, 2 or 4";
+    d->scaleShift = (decimation == 4) ? 2 : decimation - 1;
+
+    // The box average of the decimation already blurs, so the decimated plane only gets the rest of sigma
+    if (d->scaleShift)
+        d->sigma = std::max(std::sqrt(std::max(d->sigma * d->sigma - (decimation * decimation - 1) / 12.f, 0.f)) / decimation, 0.25f);
+
+    if (d->blur == 2 && d->sigma < 0.5f)
+        return d->scaleShift ? "TCanny: blur=2 requires sigma to be at least 0.5 after the decimation of scale" : "TCanny: blur=2 requires sigma to be at least 0.5";
+    if (d->threads < 0)
+        return "TCanny: threads must be greater than or equal to 0";
+    if (d->cacheSize < 0)
+        return "TCanny: cache must be greater than or equal to 0";
+    if (d->opt < 0 || d->opt > 4)
+        return "TCanny: opt must be set to 0, 1, 2, 3 or 4";
+
+    const int maxOpt = detectOpt();
+    if (d->opt == 0)
+        d->opt = maxOpt;
+    else if (d->opt > maxOpt)
+        return "TCanny: the requested opt level is not supported by this CPU";
+
+    // op=3 filters the source with sampled derivative-of-gaussian kernels instead of blurring it, so blur only applies to mode -1 there
+    const bool derivative = d->op == 3 && !d->wantBlur;
+    if (derivative && d->blur == 2)
+        return "TCanny: op=3 computes the gradient without the recursive blur, so blur=2 only applies to mode -1";
+
+    // An explicit request for the fixed-point blur keeps the gaussian kernel, which is the only blur it implements
+    if (d->blur == 0)
+        d->blur = (d->sigma >= iirCrossover && (fixedAuto || !d->fixed) && !derivative) ? 2 : 1;
+
+    // The int16 intermediates keep 15 - bitsPerSample fractional bits, so the fixed-point blur stops at 12 bits to keep at least three
+    const bool fixedCapable = d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample <= 12 && d->opt > 1 && d->blur == 1 && !derivative;
+    if (fixedAuto)
+        d->fixed = fixedCapable;
+    else if (d->fixed && !fixedCapable)
+        return "TCanny: fixed requires 8-12 bits integer input, opt other than 1, blur=1 and an op other than 3";
+
+    const int coarseWidth = (d->vi->width + decimation - 1) / decimation;
+    d->coarseStride = ((coarseWidth * d->vi->format->bytesPerSample + 63) & ~63) / d->vi->format->bytesPerSample;
+
+    if (d->vi->format->sampleType == stInteger) {
+        const float scale = static_cast<float>(1 << (d->vi->format->bitsPerSample - 8));
+        d->t_h *= scale;
+        d->t_l *= scale;
+        d->bins = 1 << d->vi->format->bitsPerSample;
+        d->peak = d->bins - 1;
+    } else {
+        d->t_h /= 255.f;
+        d->t_l /= 255.f;
+        d->bins = 1;
+
+        for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+            if (d->process[plane]) {
+                if (plane == 0 || d->vi->format->colorFamily == cmRGB) {
+                    d->lower[plane] = 0.f;
+                    d->upper[plane] = 1.f;
+                } else {
+                    d->lower[plane] = -0.5f;
+                    d->upper[plane] = 0.5f;
+                }
+            }
+        }
+    }
+
+    iirCoefficients(d->sigma, d->iir);
+    d->weights = gaussianWeights(d->sigma, d->grad);
+    if (!d->weights)
+        return "TCanny: malloc failure (weights)";
+
+    if (d->fixed) {
+        d->weightsFixed = fixedWeights(d->weights, d->grad);
+        if (!d->weightsFixed)
+            return "TCanny: malloc failure (weights)";
+    }
+
+    if (derivative) {
+        d->derivative = derivativeWeights(d->weights, d->grad);
+        if (!d->derivative)
+            return "TCanny: malloc failure (weights)";
+    }
+
+    // A gradient over pixels of the decimated plane spans scale source pixels, so it comes out scale times larger
+    d->t_h *= decimation;
+    d->t_l *= decimation;
+    d->magnitude = 255.f / (d->gmmax * decimation);
+    d->statsUnit = ((d->vi->format->sampleType == stInteger) ? static_cast<float>(1 << (d->vi->format->bitsPerSample - 8)) : 1.f / 255.f) * decimation;
+    selectKernels(d);
+
+    // opt=1 is the whole-plane reference path and always runs on the calling thread
+    if (d->threads == 0)
+        d->threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    if (d->opt == 1)
+        d->threads = 1;
+    if (d->threads > 1) {
+        d->pool = new ThreadPool(d->threads - 1);
+        d->concurrentPlanes = std::count(d->process, d->process + d->vi->format->numPlanes, true) > 1;
+    }
+    return nullptr;
+}
+
+void VS_CC tcannyCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<TCannyData> d(new TCannyData());
+    int err;
+
+    d->sigma = static_cast<float>(vsapi->propGetFloat(in, "sigma", 0, &err));
+    if (err)
+        d->sigma = 1.5f;
+    d->t_h = static_cast<float>(vsapi->propGetFloat(in, "t_h", 0, &err));
+    if (err)
+        d->t_h = 8.f;
+    d->t_l = static_cast<float>(vsapi->propGetFloat(in, "t_l", 0, &err));
+    if (err)
+        d->t_l = 1.f;
+    d->nms = int64ToIntS(vsapi->propGetInt(in, "nms", 0, &err));
+    if (err)
+        d->nms = 3;
+    d->outputs = std::max(vsapi->propNumElements(in, "mode"), 1);
+    d->op = int64ToIntS(vsapi->propGetInt(in, "op", 0, &err));
+    if (err)
+        d->op = 1;
+    d->gmmax = static_cast<float>(vsapi->propGetFloat(in, "gmmax", 0, &err));
+    if (err)
+        d->gmmax = 50.f;
+    d->opt = int64ToIntS(vsapi->propGetInt(in, "opt", 0, &err));
+    d->fixed = !!vsapi->propGetInt(in, "fixed", 0, &err);
+    const bool fixedAuto = err != 0;
+    d->blur = int64ToIntS(vsapi->propGetInt(in, "blur", 0, &err));
+    d->threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+    if (err)
+        d->threads = 1;
+    d->debug = !!vsapi->propGetInt(in, "debug", 0, &err);
+    d->cacheSize = int64ToIntS(vsapi->propGetInt(in, "cache", 0, &err));
+    d->mask8 = !!vsapi->propGetInt(in, "mask8", 0, &err);
+    d->stats = !!vsapi->propGetInt(in, "stats", 0, &err);
+    int decimation = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+    if (err)
+        decimation = 1;
+
+    if (d->outputs > 4) {
+        vsapi->setError(out, "TCanny: at most 4 modes can be output at once");
         return;
     }
+    for (int i = 0; i < d->outputs; i++)
+        d->modes[i] = int64ToIntS(vsapi->propGetInt(in, "mode", i, &err));
 
-    d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
-    d.vi = vsapi->getVideoInfo(d.node);
+    d->node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d->vi = vsapi->getVideoInfo(d->node);
 
-    if (!isConstantFormat(d.vi) || (d.vi->format->sampleType == stInteger && d.vi->format->bitsPerSample > 16) ||
-        (d.vi->format->sampleType == stFloat && d.vi->format->bitsPerSample != 32)) {
-        vsapi->setError(out, "TCanny: only constant format 8-16 bits integer and 32 bits float input supported");
-        vsapi->freeNode(d.node);
+    if (!isConstantFormat(d->vi) || (d->vi->format->sampleType == stInteger && d->vi->format->bitsPerSample > 16) ||
+        (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample != 16 && d->vi->format->bitsPerSample != 32)) {
+        vsapi->setError(out, "TCanny: only constant format 8-16 bits integer and 16/32 bits float input supported");
+        vsapi->freeNode(d->node);
         return;
     }
 
     const int m = vsapi->propNumElements(in, "planes");
 
     for (int i = 0; i < 3; i++)
-        d.process[i] = m <= 0;
+        d->process[i] = m <= 0;
 
     for (int i = 0; i < m; i++) {
         const int n = int64ToIntS(vsapi->propGetInt(in, "planes", i, nullptr));
 
-        if (n < 0 || n >= d.vi->format->numPlanes) {
+        if (n < 0 || n >= d->vi->format->numPlanes) {
             vsapi->setError(out, "TCanny: plane index out of range");
-            vsapi->freeNode(d.node);
+            vsapi->freeNode(d->node);
             return;
         }
 
-        if (d.process[n]) {
+        if (d->process[n]) {
             vsapi->setError(out, "TCanny: plane specified twice");
-            vsapi->freeNode(d.node);
+            vsapi->freeNode(d->node);
             return;
         }
 
-        d.process[n] = true;
+        d->process[n] = true;
     }
 
-    if (d.vi->format->sampleType == stInteger) {
-        const float scale = static_cast<float>(1 << (d.vi->format->bitsPerSample - 8));
-        d.t_h *= scale;
-        d.t_l *= scale;
-        d.bins = 1 << d.vi->format->bitsPerSample;
-        d.peak = d.bins - 1;
-    } else {
-        d.t_h /= 255.f;
-        d.t_l /= 255.f;
-        d.bins = 1;
-
-        for (int plane = 0; plane < d.vi->format->numPlanes; plane++) {
-            if (d.process[plane]) {
-                if (plane == 0 || d.vi->format->colorFamily == cmRGB) {
-                    d.lower[plane] = 0.f;
-                    d.upper[plane] = 1.f;
-                } else {
-                    d.lower[plane] = -0.5f;
-                    d.upper[plane] = 0.5f;
-                }
-            }
+    d->roi[0] = d->roi[1] = 0;
+    d->roi[2] = d->vi->width;
+    d->roi[3] = d->vi->height;
+    const int r = vsapi->propNumElements(in, "roi");
+    if (r > 0) {
+        if (r != 4) {
+            vsapi->setError(out, "TCanny: roi must be given as left, top, width and height");
+            vsapi->freeNode(d->node);
+            return;
+        }
+        for (int i = 0; i < 4; i++)
+            d->roi[i] = int64ToIntS(vsapi->propGetInt(in, "roi", i, nullptr));
+        d->roi[2] += d->roi[0];
+        d->roi[3] += d->roi[1];
+        if (d->roi[0] < 0 || d->roi[1] < 0 || d->roi[2] <= d->roi[0] || d->roi[3] <= d->roi[1] || d->roi[2] > d->vi->width || d->roi[3] > d->vi->height) {
+            vsapi->setError(out, "TCanny: roi must lie within the frame and not be empty");
+            vsapi->freeNode(d->node);
+            return;
+        }
+    }
+
+    d->mask = vsapi->propGetNode(in, "mask", 0, &err);
+    if (d->mask) {
+        const VSVideoInfo * vi = vsapi->getVideoInfo(d->mask);
+        const char * error = nullptr;
+        if (!isConstantFormat(vi) || vi->width != d->vi->width || vi->height != d->vi->height)
+            error = "TCanny: mask must have a constant format and the dimensions of clip";
+        else if ((vi->format->sampleType == stInteger && vi->format->bitsPerSample > 16) ||
+                 (vi->format->sampleType == stFloat && vi->format->bitsPerSample != 16 && vi->format->bitsPerSample != 32))
+            error = "TCanny: only 8-16 bits integer and 16/32 bits float masks supported";
+        else if (d->cacheSize) // the cache compares source frames only, so it would return the results of one mask for another
+            error = "TCanny: cache cannot be used with mask";
+        if (error) {
+            vsapi->setError(out, error);
+            vsapi->freeNode(d->mask);
+            vsapi->freeNode(d->node);
+            return;
         }
     }
+    d->region = r > 0 || d->mask;
 
-    d.weights = gaussianWeights(d.sigma, d.grad);
-    if (!d.weights) {
-        vsapi->setError(out, "TCanny: malloc failure (weights)");
-        vsapi->freeNode(d.node);
+    const char * error = initData(d.get(), decimation, fixedAuto);
+    if (error) {
+        vsapi->setError(out, error);
+        tcannyFree(d.release(), core, vsapi);
         return;
     }
 
-    d.magnitude = 255.f / d.gmmax;
+    // mask8 only changes the format of the mode 0 output, to 8 bits with the colour family and subsampling of the input
+    for (int k = 0; k < d->outputs; k++)
+        d->formats[k] = d->vi->format;
+    if (d->mask8) {
+        const VSFormat * format = d->vi->format;
+        const VSFormat * mask = vsapi->registerFormat(format->colorFamily, stInteger, 8, format->subSamplingW, format->subSamplingH, core);
+        for (int k = 0; k < d->outputs; k++) {
+            if (d->modes[k] == 0 && mask != format)
+                d->formats[k] = mask;
+        }
+    }
 
-    TCannyData * data = new TCannyData(d);
+    // Enough room for every frame that the core may have in flight
+    d->pendingLimit = static_cast<size_t>(std::max(vsapi->getCoreInfo(core)->numThreads, 1)) * 2;
 
-    vsapi->createFilter(in, out, "TCanny", tcannyInit, tcannyGetFrame, tcannyFree, fmParallel, 0, data, core);
+    vsapi->createFilter(in, out, "TCanny", tcannyInit, tcannyGetFrame, tcannyFree, fmParallel, 0, d.release(), core);
 }
 
-//////////////////////////////////////////
-// Init
+template void genConvV<uint8_t>(const uint8_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset);
+template void genConvV<uint16_t>(const uint16_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset);
+template void genConvV<Half>(const Half * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset);
+template void genConvV<float>(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset);
 
-VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
-    configFunc("com.holywu.tcanny", "tcanny", "Build an edge map using canny edge detection", VAPOURSYNTH_API_VERSION, 1, plugin);
-    registerFunc("TCanny", "clip:clip;sigma:float:opt;t_h:float:opt;t_l:float:opt;nms:int:opt;mode:int:opt;op:int:opt;gmmax:float:opt;planes:int[]:opt;", tcannyCreate, nullptr, plugin);
-}
+template void iirBlur<uint8_t>(const uint8_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset);
+template void iirBlur<uint16_t>(const uint16_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset);
+template void iirBlur<Half>(const Half * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset);
+template void iirBlur<float>(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset);
+
+template void derivativeImages<uint8_t>(const uint8_t * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height, const int stride, const float offset, const TCannyData * d, StageTimer & timer);
+template void derivativeImages<uint16_t>(const uint16_t * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height, const int stride, const float offset, const TCannyData * d, StageTimer & timer);
+template void derivativeImages<Half>(const Half * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height, const int stride, const float offset, const TCannyData * d, StageTimer & timer);
+template void derivativeImages<float>(const float * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height, const int stride, const float offset, const TCannyData * d, StageTimer & timer);
+
+template void blurBand<uint8_t, int16_t>(const uint8_t * srcp, uint8_t * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+template void blurBand<uint16_t, int16_t>(const uint16_t * srcp, uint16_t * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+template void blurBand<uint8_t, float>(const uint8_t * srcp, uint8_t * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+template void blurBand<uint16_t, float>(const uint16_t * srcp, uint16_t * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+template void blurBand<Half, float>(const Half * srcp, Half * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+template void blurBand<float, float>(const float * srcp, float * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride, const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+
+template void outputRows<uint8_t>(float * fa[3], uint8_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputRows<uint16_t>(float * fa[3], uint16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputRows<Half>(float * fa[3], Half * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputRows<float>(float * fa[3], float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+
+template void outputSweepRows<uint8_t>(const SweepTargets & out, const float * blurred, uint8_t * dstp, const int width, const int y0, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputSweepRows<uint16_t>(const SweepTargets & out, const float * blurred, uint16_t * dstp, const int width, const int y0, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputSweepRows<Half>(const SweepTargets & out, const float * blurred, Half * dstp, const int width, const int y0, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+template void outputSweepRows<float>(const SweepTargets & out, const float * blurred, float * dstp, const int width, const int y0, const int height, const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
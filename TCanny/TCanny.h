@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <vapoursynth/VapourSynth.h>
+#include <vapoursynth/VSHelper.h>
+#include "ThreadPool.h"
+
+#define M_PIF 3.14159265358979323846f
+
+// A sample of a 16-bit float clip, converted to and from float with the rounding of F16C
+struct Half {
+    uint16_t bits;
+
+    Half() = default;
+
+    Half(const float value) {
+        uint32_t f;
+        memcpy(&f, &value, sizeof(f));
+        const uint32_t sign = f & 0x80000000;
+        f ^= sign;
+        if (f >= 0x47800000) {
+            // Infinity, NaN, or rounds past the largest half
+            bits = (f > 0x7F800000) ? 0x7E00 : 0x7C00;
+        } else if (f < 0x38800000) {
+            // Denormal half: adding 0.5 rounds the value to a multiple of 2^-24, the half denormal step, in the low mantissa bits
+            float v;
+            memcpy(&v, &f, sizeof(v));
+            v += 0.5f;
+            memcpy(&f, &v, sizeof(f));
+            bits = static_cast<uint16_t>(f - 0x3F000000);
+        } else {
+            // Rebias the exponent and round the 13 dropped mantissa bits to nearest even
+            f += 0xC8000FFF + ((f >> 13) & 1);
+            bits = static_cast<uint16_t>(f >> 13);
+        }
+        bits |= sign >> 16;
+    }
+
+    operator float() const {
+        uint32_t f = (bits & 0x7FFF) << 13;
+        const uint32_t exponent = f & 0x0F800000;
+        f += (127 - 15) << 23;
+        float value;
+        if (exponent == 0x0F800000) {
+            // Infinity or NaN
+            f += (128 - 16) << 23;
+            memcpy(&value, &f, sizeof(value));
+        } else if (exponent == 0) {
+            // Denormal half: renormalize by adding the implicit bit and subtracting it again as 2^-14
+            f += 1 << 23;
+            memcpy(&value, &f, sizeof(value));
+            value -= 6.103515625e-05f;
+        } else {
+            memcpy(&value, &f, sizeof(value));
+        }
+        memcpy(&f, &value, sizeof(f));
+        f |= (bits & 0x8000) << 16;
+        memcpy(&value, &f, sizeof(value));
+        return value;
+    }
+};
+
+struct Stack {
+    uint8_t * map;
+    std::pair<int, int> * pos;
+    int index;
+};
+
+// A horizontal run of hysteresis candidates; runs are the nodes of the union-find used by the banded hysteresis
+struct Run {
+    int x0, x1;
+    int parent;
+    bool seeded;
+};
+
+// A rectangle of a plane, [x0, x1) by [y0, y1)
+struct Rect {
+    int x0, y0, x1, y1;
+};
+
+// Working set of one frame in progress, reused by the frames after it
+struct Scratch {
+    float * fa[3][3];
+    float * blurred[3];
+    uint8_t * edges[3];
+    Stack stack;
+    std::vector<Run> runs[3];
+    std::vector<int> rowStart[3];
+    uint8_t * inside;
+    std::vector<std::pair<int, int>> spans[3];
+    std::vector<Rect> rects[3];
+    uint8_t * selected[3];
+    uint8_t * coarse[3][5];
+};
+
+// Stages reported by debug, in the order a plane passes through them
+enum DebugStage { debugBlurV, debugBlurH, debugGradient, debugNMS, debugHysteresis, debugOutput, debugStages };
+
+// What debug measures on one plane of one frame; times are in nanoseconds
+struct PlaneStats {
+    std::atomic<int64_t> time[debugStages];
+    int64_t seeds, visited, depth, runs;
+};
+
+// Adds the time between lap() calls to the stage of each call; a null `times` never reads the clock
+class StageTimer {
+public:
+    explicit StageTimer(std::atomic<int64_t> * times) : times(times), elapsed() {
+        if (times)
+            last = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer() {
+        if (!times)
+            return;
+        for (int i = 0; i < debugStages; i++) {
+            if (elapsed[i])
+                times[i] += elapsed[i];
+        }
+    }
+
+    void lap(const int stage) {
+        if (!times)
+            return;
+        const auto now = std::chrono::steady_clock::now();
+        elapsed[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+    }
+
+private:
+    std::atomic<int64_t> * times;
+    int64_t elapsed[debugStages];
+    std::chrono::steady_clock::time_point last;
+};
+
+// What stats measures on one plane of one frame, over the pixels that roi and mask select
+static const int statsBins = 16;
+
+struct EdgeStats {
+    int64_t pixels, edges;
+    double sum;
+    float max;
+    int64_t histogram[statsBins];
+};
+
+// Frame n of a list of modes, with the frames computed for the outputs that have not had it yet
+struct PendingFrame {
+    int n;
+    int computing; // the outputs computing it
+    bool served[4];
+    VSFrameRef * frame[4];
+};
+
+// The results of one source frame, found again by the hash of its processed planes and confirmed by comparing them with `src`
+struct CacheEntry {
+    uint64_t id, hash;
+    const VSFrameRef * src;
+    const VSFrameRef * dst[4];
+};
+
+struct TCannyData;
+
+// Where the row sweep of one plane leaves its results; null for what no output mode reads
+struct SweepTargets {
+    uint8_t * edges;
+    void * magnitude;
+    void * direction;
+    EdgeStats * stats;
+    const uint8_t * selected;
+};
+
+// Kernels instantiated for one op, nms and set of output modes, picked by selectKernels when the filter is created
+typedef void (*SweepFunc)(const void * srcp, const SweepTargets & out, const float * blurred, float * VS_RESTRICT rows, const int width, const int height,
+                          const int stride, const int y0, const int y1, const int plane, const TCannyData * d, const float offset, StageTimer & timer);
+typedef void (*GMDirFunc)(float * VS_RESTRICT srcp, float * VS_RESTRICT gimg, float * VS_RESTRICT dimg, const int width, const int height, const int stride,
+                          const TCannyData * d, EdgeStats * stats, const uint8_t * selected, StageTimer & timer);
+
+struct TCannyData {
+    VSNodeRef * node;
+    const VSVideoInfo * vi;
+    float sigma, t_h, t_l, gmmax;
+    int nms, op, opt;
+    int modes[4], outputs; // one output clip per mode, all computed from a single blur and gradient pass
+    const VSFormat * formats[4]; // the format of each output: that of the clip, except for the 8-bit mode 0 output of mask8
+    bool mask8;
+    bool wantBlur, wantEdges, wantMagnitude, wantDirection; // planes the shared stages have to produce for these modes
+    bool process[3];
+    int roi[4]; // left, top, right and bottom of the selected area in luma pixels, the whole frame without roi
+    VSNodeRef * mask;
+    bool region; // roi or mask restrict the processing to the pixels they select
+    int scaleShift, coarseStride; // scale: log2 of the decimation factor, and the stride in samples of the decimated planes
+    SweepFunc sweep;
+    GMDirFunc gmDirImages;
+    int grad, bins;
+    float * weights;
+    float * derivative; // op=3: the gaussian weights times their offset, for the derivative-of-gaussian gradient
+    int16_t * weightsFixed;
+    bool fixed;
+    int blur;
+    float iir[4];
+    float magnitude;
+    int peak;
+    float lower[3], upper[3];
+    int threads;
+    bool concurrentPlanes;
+    ThreadPool * pool;
+    bool debug;
+    bool stats;
+    float statsUnit; // stats: a gradient of 1 in the 8-bit units of t_h and gmmax, in the units of the plane
+    std::vector<Scratch *> scratch, idleScratch; // every working set, and those no frame is using
+    std::vector<float *> rows, idleRows; // ring buffers of the row sweep, one per band in progress
+    std::mutex scratchMutex;
+    std::atomic<size_t> scratchBytes; // held in scratch and rows, the peak of what the frames and bands in progress at once needed
+    std::deque<PendingFrame> pending; // oldest first
+    size_t pendingLimit;
+    bool requested[4]; // the outputs that have asked for a frame, the only ones that frames are kept for
+    std::mutex pendingMutex;
+    int cacheSize;
+    std::list<CacheEntry> cache; // most recently used first
+    uint64_t cacheEntries; // the ids given to entries so far
+    int64_t cacheLookups, cacheHits;
+    std::mutex cacheMutex;
+};
+
+// Mirror an out-of-range coordinate back into [0, n), folding repeatedly when the kernel is wider than the plane
+static inline int reflect(int i, const int n) {
+    if (n == 1)
+        return 0;
+    while (i < 0 || i >= n) {
+        if (i < 0)
+            i = -i;
+        else
+            i = 2 * (n - 1) - i;
+    }
+    return i;
+}
+
+// Fixed-point blur: Q14 weights that sum to exactly 1 << fixedWeightBits, and int16 intermediates
+static const int fixedWeightBits = 14;
+
+static inline int32_t weightPair(const int16_t * weights) {
+    int32_t pair;
+    memcpy(&pair, weights, sizeof(pair));
+    return pair;
+}
+
+static inline int16_t convHFixedPixel(const int16_t * srcp, const int x, const int width, const int rad, const int16_t * weights) {
+    int sum = 1 << (fixedWeightBits - 1);
+    for (int v = -rad; v <= rad; v++)
+        sum += srcp[reflect(x + v, width)] * weights[v];
+    return sum >> fixedWeightBits;
+}
+
+// Row kernels for the fused pipeline: convV blurs source row y vertically, convH blurs one float row horizontally
+template<typename T> void convV_sse2(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template<typename T> void convV_avx2(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template<typename T> void convV_avx512(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+
+void convH_sse2(const float * srcp, float * VS_RESTRICT dstp, const int width, const int rad, const float * weights);
+void convH_avx2(const float * srcp, float * VS_RESTRICT dstp, const int width, const int rad, const float * weights);
+void convH_avx512(const float * srcp, float * VS_RESTRICT dstp, const int width, const int rad, const float * weights);
+
+// Rounding of float rows to half, for the fp16 outputs
+void storeHalf_sse2(const float * srcp, Half * VS_RESTRICT dstp, const int width);
+void storeHalf_avx2(const float * srcp, Half * VS_RESTRICT dstp, const int width);
+void storeHalf_avx512(const float * srcp, Half * VS_RESTRICT dstp, const int width);
+
+template<typename T> void convVFixed_sse2(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
+template<typename T> void convVFixed_avx2(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
+template<typename T> void convVFixed_avx512(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
+
+void convHFixed_sse2(const int16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int rad, const int16_t * weights);
+void convHFixed_avx2(const int16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int rad, const int16_t * weights);
+void convHFixed_avx512(const int16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int rad, const int16_t * weights);
+
+// Defined in TCanny.cpp, and reached from the benchmark and the test as well
+int detectOpt();
+
+template<typename T> void genConvV(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights, const float offset);
+void genConvH(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int rad, const float * weights);
+template<typename T> void iirBlur(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const float coeff[4], const float offset);
+template<typename T> void derivativeImages(const T * srcp, float * VS_RESTRICT tmp, float * VS_RESTRICT gximg, float * VS_RESTRICT gyimg, const int width, const int height,
+                                           const int stride, const float offset, const TCannyData * d, StageTimer & timer);
+template<typename T, typename B> void blurBand(const T * srcp, T * VS_RESTRICT dstp, float * VS_RESTRICT rows, const int width, const int height, const int stride,
+                                               const int y0, const int y1, const int plane, const float offset, const TCannyData * d, StageTimer & timer);
+
+void hystersis(float * VS_RESTRICT srcp, Stack & VS_RESTRICT stack, const int width, const int height, const int stride, const float t_h, const float t_l,
+               PlaneStats * stats, EdgeStats * edgeStats, const uint8_t * selected);
+void hysteresisBands(uint8_t * VS_RESTRICT srcp, std::vector<Run> & runs, std::vector<int> & rowStart, const int width, const int height, const int stride,
+                     const TCannyData * d, PlaneStats * stats, EdgeStats * edgeStats, const uint8_t * selected);
+
+template<typename T> void outputRows(float * fa[3], T * VS_RESTRICT dstp, const int width, const int height, const int stride, const int plane, const float offset,
+                                     const int mode, const TCannyData * d);
+template<typename T> void outputSweepRows(const SweepTargets & out, const float * blurred, T * dstp, const int width, const int y0, const int height,
+                                          const int stride, const int plane, const float offset, const int mode, const TCannyData * d);
+
+std::deque<PendingFrame>::iterator findPending(TCannyData * d, const int n);
+VSFrameRef * takePending(TCannyData * d, const int n, const int output, const bool claim);
+void putPending(TCannyData * d, const int n, VSFrameRef * const * dst, const int output, const bool served, const VSAPI * vsapi);
+
+uint64_t hashFrame(const VSFrameRef * frame, const TCannyData * d, const VSAPI * vsapi);
+const VSFrameRef * lookupCache(TCannyData * d, const uint64_t hash, const VSFrameRef * src, const int output, const VSAPI * vsapi);
+void putCache(TCannyData * d, const uint64_t hash, const VSFrameRef * src, VSFrameRef * const * dst, const VSAPI * vsapi);
+
+const char * initData(TCannyData * d, const int decimation, const bool fixedAuto);
+void VS_CC tcannyCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
@@ -0,0 +1,180 @@
+#include <immintrin.h>
+#include "TCanny.h"
+
+template<typename T> static inline __m512 load_ps(const T * srcp);
+
+template<>
+inline __m512 load_ps(const uint8_t * srcp) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(srcp))));
+}
+
+template<>
+inline __m512 load_ps(const uint16_t * srcp) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(srcp))));
+}
+
+template<>
+inline __m512 load_ps(const float * srcp) {
+    return _mm512_loadu_ps(srcp);
+}
+
+template<>
+inline __m512 load_ps(const Half * srcp) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(srcp)));
+}
+
+template<typename T, bool border>
+static inline void convVRow(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset) {
+    const __m512 off = _mm512_set1_ps(offset);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        const T * s = srcp + (border ? 0 : (y - rad) * stride) + x;
+        for (int v = -rad; v <= rad; v++) {
+            if (border)
+                s = srcp + reflect(y + v, height) * stride + x;
+            const __m512 w = _mm512_set1_ps(weights[v]);
+            sum0 = _mm512_fmadd_ps(_mm512_add_ps(load_ps(s), off), w, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_add_ps(load_ps(s + 16), off), w, sum1);
+            s += stride;
+        }
+        _mm512_storeu_ps(dstp + x, sum0);
+        _mm512_storeu_ps(dstp + x + 16, sum1);
+    }
+    for (; x < width; x++) {
+        float sum = 0.f;
+        for (int v = -rad; v <= rad; v++)
+            sum += (srcp[x + reflect(y + v, height) * stride] + offset) * weights[v];
+        dstp[x] = sum;
+    }
+}
+
+template<typename T>
+void convV_avx512(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset) {
+    weights += rad;
+    if (y < rad || y >= height - rad)
+        convVRow<T, true>(srcp, dstp, width, height, stride, y, rad, weights, offset);
+    else
+        convVRow<T, false>(srcp, dstp, width, height, stride, y, rad, weights, offset);
+}
+
+static inline float convHPixel(const float * srcp, const int x, const int width, const int rad, const float * weights) {
+    float sum = 0.f;
+    for (int v = -rad; v <= rad; v++)
+        sum += srcp[reflect(x + v, width)] * weights[v];
+    return sum;
+}
+
+void convH_avx512(const float * srcp, float * VS_RESTRICT dstp, const int width, const int rad, const float * weights) {
+    weights += rad;
+    const int left = std::min(rad, width);
+    const int right = std::max(width - rad, left);
+    int x = 0;
+    for (; x < left; x++)
+        dstp[x] = convHPixel(srcp, x, width, rad, weights);
+    for (; x + 32 <= right; x += 32) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        const float * s = srcp + x - rad;
+        for (int v = -rad; v <= rad; v++) {
+            const __m512 w = _mm512_set1_ps(weights[v]);
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(s), w, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(s + 16), w, sum1);
+            s++;
+        }
+        _mm512_storeu_ps(dstp + x, sum0);
+        _mm512_storeu_ps(dstp + x + 16, sum1);
+    }
+    for (; x < width; x++)
+        dstp[x] = convHPixel(srcp, x, width, rad, weights);
+}
+
+template<typename T> static inline __m512i load_epi16(const T * srcp);
+
+template<>
+inline __m512i load_epi16(const uint8_t * srcp) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(srcp)));
+}
+
+template<>
+inline __m512i load_epi16(const uint16_t * srcp) {
+    return _mm512_loadu_si512(srcp);
+}
+
+// Interleaves two rows of thirty-two samples so that one madd applies a pair of taps to each pixel
+static inline void maddPair(const __m512i a, const __m512i b, const __m512i w, __m512i & sum0, __m512i & sum1) {
+    sum0 = _mm512_add_epi32(sum0, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), w));
+    sum1 = _mm512_add_epi32(sum1, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), w));
+}
+
+template<typename T, bool border>
+static inline void convVFixedRow(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad,
+                                 const int16_t * weights, const int shift) {
+    const __m512i round = _mm512_set1_epi32(1 << (shift - 1));
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m512i sum0 = round;
+        __m512i sum1 = round;
+        for (int v = -rad; v <= rad; v += 2) {
+            const int y0 = border ? reflect(y + v, height) : y + v;
+            const int y1 = (v == rad) ? y0 : (border ? reflect(y + v + 1, height) : y + v + 1);
+            maddPair(load_epi16(srcp + y0 * stride + x), load_epi16(srcp + y1 * stride + x), _mm512_set1_epi32(weightPair(weights + v)), sum0, sum1);
+        }
+        _mm512_storeu_si512(dstp + x, _mm512_packs_epi32(_mm512_srai_epi32(sum0, shift), _mm512_srai_epi32(sum1, shift)));
+    }
+    for (; x < width; x++) {
+        int sum = 1 << (shift - 1);
+        for (int v = -rad; v <= rad; v++)
+            sum += srcp[x + reflect(y + v, height) * stride] * weights[v];
+        dstp[x] = sum >> shift;
+    }
+}
+
+template<typename T>
+void convVFixed_avx512(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad,
+                       const int16_t * weights, const int shift) {
+    weights += rad;
+    if (y < rad || y >= height - rad)
+        convVFixedRow<T, true>(srcp, dstp, width, height, stride, y, rad, weights, shift);
+    else
+        convVFixedRow<T, false>(srcp, dstp, width, height, stride, y, rad, weights, shift);
+}
+
+void convHFixed_avx512(const int16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int rad, const int16_t * weights) {
+    weights += rad;
+    const __m512i round = _mm512_set1_epi32(1 << (fixedWeightBits - 1));
+    const int left = std::min(rad, width);
+    const int right = std::max(width - rad - 1, left);
+    int x = 0;
+    for (; x < left; x++)
+        dstp[x] = convHFixedPixel(srcp, x, width, rad, weights);
+    for (; x + 32 <= right; x += 32) {
+        __m512i sum0 = round;
+        __m512i sum1 = round;
+        for (int v = -rad; v <= rad; v += 2) {
+            const int16_t * s = srcp + x + v;
+            maddPair(_mm512_loadu_si512(s), _mm512_loadu_si512(s + 1), _mm512_set1_epi32(weightPair(weights + v)), sum0, sum1);
+        }
+        _mm512_storeu_si512(dstp + x,
+                            _mm512_packs_epi32(_mm512_srai_epi32(sum0, fixedWeightBits), _mm512_srai_epi32(sum1, fixedWeightBits)));
+    }
+    for (; x < width; x++)
+        dstp[x] = convHFixedPixel(srcp, x, width, rad, weights);
+}
+
+void storeHalf_avx512(const float * srcp, Half * VS_RESTRICT dstp, const int width) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dstp + x), _mm512_cvtps_ph(_mm512_loadu_ps(srcp + x), _MM_FROUND_TO_NEAREST_INT));
+    for (; x < width; x++)
+        dstp[x] = srcp[x];
+}
+
+template void convV_avx512<uint8_t>(const uint8_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_avx512<uint16_t>(const uint16_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_avx512<float>(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_avx512<Half>(const Half * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+
+template void convVFixed_avx512<uint8_t>(const uint8_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
+template void convVFixed_avx512<uint16_t>(const uint16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
@@ -0,0 +1,217 @@
+#include <cstring>
+#include <emmintrin.h>
+#include "TCanny.h"
+
+template<typename T> static inline __m128 load_ps(const T * srcp);
+
+template<>
+inline __m128 load_ps(const uint8_t * srcp) {
+    int32_t tmp;
+    memcpy(&tmp, srcp, sizeof(tmp));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(tmp), zero), zero);
+    return _mm_cvtepi32_ps(v);
+}
+
+template<>
+inline __m128 load_ps(const uint16_t * srcp) {
+    const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(srcp));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+template<>
+inline __m128 load_ps(const float * srcp) {
+    return _mm_loadu_ps(srcp);
+}
+
+// SSE2 has no half conversion, so these follow the scalar conversions of Half lane by lane
+template<>
+inline __m128 load_ps(const Half * srcp) {
+    const __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(srcp)), _mm_setzero_si128());
+    const __m128i f = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7FFF)), 13);
+    const __m128i exponent = _mm_and_si128(f, _mm_set1_epi32(0x0F800000));
+    const __m128i special = _mm_cmpeq_epi32(exponent, _mm_set1_epi32(0x0F800000));
+    const __m128i denormal = _mm_cmpeq_epi32(exponent, _mm_setzero_si128());
+    __m128i bits = _mm_add_epi32(f, _mm_set1_epi32((127 - 15) << 23));
+    bits = _mm_add_epi32(bits, _mm_and_si128(special, _mm_set1_epi32((128 - 16) << 23)));
+    bits = _mm_add_epi32(bits, _mm_and_si128(denormal, _mm_set1_epi32(1 << 23)));
+    const __m128 value = _mm_sub_ps(_mm_castsi128_ps(bits), _mm_and_ps(_mm_castsi128_ps(denormal), _mm_set1_ps(6.103515625e-05f)));
+    return _mm_or_ps(value, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16)));
+}
+
+// Four halves in the low 16 bits of each lane
+static inline __m128i toHalf(const __m128 value) {
+    const __m128i sign = _mm_and_si128(_mm_castps_si128(value), _mm_set1_epi32(static_cast<int>(0x80000000)));
+    const __m128i f = _mm_xor_si128(_mm_castps_si128(value), sign);
+    const __m128i nan = _mm_cmpgt_epi32(f, _mm_set1_epi32(0x7F800000));
+    const __m128i special = _mm_or_si128(_mm_set1_epi32(0x7C00), _mm_and_si128(nan, _mm_set1_epi32(0x0200)));
+    const __m128i denormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(f), _mm_set1_ps(0.5f))), _mm_set1_epi32(0x3F000000));
+    const __m128i odd = _mm_and_si128(_mm_srli_epi32(f, 13), _mm_set1_epi32(1));
+    const __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(f, _mm_set1_epi32(static_cast<int>(0xC8000FFF))), odd), 13);
+    const __m128i isDenormal = _mm_cmplt_epi32(f, _mm_set1_epi32(0x38800000));
+    const __m128i isSpecial = _mm_cmpgt_epi32(f, _mm_set1_epi32(0x477FFFFF));
+    __m128i h = _mm_or_si128(_mm_and_si128(isDenormal, denormal), _mm_andnot_si128(isDenormal, normal));
+    h = _mm_or_si128(_mm_and_si128(isSpecial, special), _mm_andnot_si128(isSpecial, h));
+    return _mm_or_si128(h, _mm_srli_epi32(sign, 16));
+}
+
+template<typename T, bool border>
+static inline void convVRow(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset) {
+    const __m128 off = _mm_set1_ps(offset);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        const T * s = srcp + (border ? 0 : (y - rad) * stride) + x;
+        for (int v = -rad; v <= rad; v++) {
+            if (border)
+                s = srcp + reflect(y + v, height) * stride + x;
+            const __m128 w = _mm_set1_ps(weights[v]);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_add_ps(load_ps(s), off), w));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_add_ps(load_ps(s + 4), off), w));
+            s += stride;
+        }
+        _mm_storeu_ps(dstp + x, sum0);
+        _mm_storeu_ps(dstp + x + 4, sum1);
+    }
+    for (; x < width; x++) {
+        float sum = 0.f;
+        for (int v = -rad; v <= rad; v++)
+            sum += (srcp[x + reflect(y + v, height) * stride] + offset) * weights[v];
+        dstp[x] = sum;
+    }
+}
+
+template<typename T>
+void convV_sse2(const T * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset) {
+    weights += rad;
+    if (y < rad || y >= height - rad)
+        convVRow<T, true>(srcp, dstp, width, height, stride, y, rad, weights, offset);
+    else
+        convVRow<T, false>(srcp, dstp, width, height, stride, y, rad, weights, offset);
+}
+
+static inline float convHPixel(const float * srcp, const int x, const int width, const int rad, const float * weights) {
+    float sum = 0.f;
+    for (int v = -rad; v <= rad; v++)
+        sum += srcp[reflect(x + v, width)] * weights[v];
+    return sum;
+}
+
+void convH_sse2(const float * srcp, float * VS_RESTRICT dstp, const int width, const int rad, const float * weights) {
+    weights += rad;
+    const int left = std::min(rad, width);
+    const int right = std::max(width - rad, left);
+    int x = 0;
+    for (; x < left; x++)
+        dstp[x] = convHPixel(srcp, x, width, rad, weights);
+    for (; x + 8 <= right; x += 8) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        const float * s = srcp + x - rad;
+        for (int v = -rad; v <= rad; v++) {
+            const __m128 w = _mm_set1_ps(weights[v]);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(s), w));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(s + 4), w));
+            s++;
+        }
+        _mm_storeu_ps(dstp + x, sum0);
+        _mm_storeu_ps(dstp + x + 4, sum1);
+    }
+    for (; x < width; x++)
+        dstp[x] = convHPixel(srcp, x, width, rad, weights);
+}
+
+template<typename T> static inline __m128i load_epi16(const T * srcp);
+
+template<>
+inline __m128i load_epi16(const uint8_t * srcp) {
+    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(srcp)), _mm_setzero_si128());
+}
+
+template<>
+inline __m128i load_epi16(const uint16_t * srcp) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(srcp));
+}
+
+// Interleaves two rows of eight samples so that one madd applies a pair of taps to each pixel
+static inline void maddPair(const __m128i a, const __m128i b, const __m128i w, __m128i & sum0, __m128i & sum1) {
+    sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+    sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+}
+
+template<typename T, bool border>
+static inline void convVFixedRow(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad,
+                                 const int16_t * weights, const int shift) {
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i sum0 = round;
+        __m128i sum1 = round;
+        for (int v = -rad; v <= rad; v += 2) {
+            const int y0 = border ? reflect(y + v, height) : y + v;
+            const int y1 = (v == rad) ? y0 : (border ? reflect(y + v + 1, height) : y + v + 1);
+            maddPair(load_epi16(srcp + y0 * stride + x), load_epi16(srcp + y1 * stride + x), _mm_set1_epi32(weightPair(weights + v)), sum0, sum1);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstp + x), _mm_packs_epi32(_mm_srai_epi32(sum0, shift), _mm_srai_epi32(sum1, shift)));
+    }
+    for (; x < width; x++) {
+        int sum = 1 << (shift - 1);
+        for (int v = -rad; v <= rad; v++)
+            sum += srcp[x + reflect(y + v, height) * stride] * weights[v];
+        dstp[x] = sum >> shift;
+    }
+}
+
+template<typename T>
+void convVFixed_sse2(const T * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad,
+                     const int16_t * weights, const int shift) {
+    weights += rad;
+    if (y < rad || y >= height - rad)
+        convVFixedRow<T, true>(srcp, dstp, width, height, stride, y, rad, weights, shift);
+    else
+        convVFixedRow<T, false>(srcp, dstp, width, height, stride, y, rad, weights, shift);
+}
+
+void convHFixed_sse2(const int16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int rad, const int16_t * weights) {
+    weights += rad;
+    const __m128i round = _mm_set1_epi32(1 << (fixedWeightBits - 1));
+    const int left = std::min(rad, width);
+    const int right = std::max(width - rad - 1, left);
+    int x = 0;
+    for (; x < left; x++)
+        dstp[x] = convHFixedPixel(srcp, x, width, rad, weights);
+    for (; x + 8 <= right; x += 8) {
+        __m128i sum0 = round;
+        __m128i sum1 = round;
+        for (int v = -rad; v <= rad; v += 2) {
+            const int16_t * s = srcp + x + v;
+            maddPair(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 1)),
+                     _mm_set1_epi32(weightPair(weights + v)), sum0, sum1);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstp + x),
+                         _mm_packs_epi32(_mm_srai_epi32(sum0, fixedWeightBits), _mm_srai_epi32(sum1, fixedWeightBits)));
+    }
+    for (; x < width; x++)
+        dstp[x] = convHFixedPixel(srcp, x, width, rad, weights);
+}
+
+void storeHalf_sse2(const float * srcp, Half * VS_RESTRICT dstp, const int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m128i lo = toHalf(_mm_loadu_ps(srcp + x));
+        const __m128i hi = toHalf(_mm_loadu_ps(srcp + x + 4));
+        const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16), _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstp + x), packed);
+    }
+    for (; x < width; x++)
+        dstp[x] = srcp[x];
+}
+
+template void convV_sse2<uint8_t>(const uint8_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_sse2<uint16_t>(const uint16_t * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_sse2<float>(const float * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+template void convV_sse2<Half>(const Half * srcp, float * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const float * weights, const float offset);
+
+template void convVFixed_sse2<uint8_t>(const uint8_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
+template void convVFixed_sse2<uint16_t>(const uint16_t * srcp, int16_t * VS_RESTRICT dstp, const int width, const int height, const int stride, const int y, const int rad, const int16_t * weights, const int shift);
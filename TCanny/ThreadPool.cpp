@@ -0,0 +1,67 @@
+#include <algorithm>
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(const unsigned workers) : stop(false) {
+    for (unsigned i = 0; i < workers; i++)
+        threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto & thread : threads)
+        thread.join();
+}
+
+void ThreadPool::run(const int count, const std::function<void(int)> & task) {
+    Batch batch;
+    batch.task = &task;
+    batch.count = count;
+    batch.next = 0;
+    batch.finished = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(&batch);
+    }
+    wake.notify_all();
+
+    int claimed = 0;
+    for (int i; (i = batch.next.fetch_add(1)) < count;) {
+        task(i);
+        claimed++;
+    }
+
+    // Every index has been handed out, so no worker may pick the batch up again once it is off the queue
+    std::unique_lock<std::mutex> lock(mutex);
+    const auto it = std::find(queue.begin(), queue.end(), &batch);
+    if (it != queue.end())
+        queue.erase(it);
+    batch.finished += claimed;
+    done.wait(lock, [&] { return batch.finished == count; });
+}
+
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty())
+            return;
+
+        Batch * batch = queue.front();
+        const int i = batch->next.fetch_add(1);
+        if (i >= batch->count) {
+            queue.pop_front();
+            continue;
+        }
+
+        lock.unlock();
+        (*batch->task)(i);
+        lock.lock();
+        if (++batch->finished == batch->count)
+            done.notify_all();
+    }
+}
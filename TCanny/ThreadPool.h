@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads shared by every frame of one instance; run() may be called from any thread, also from a task
+class ThreadPool {
+public:
+    explicit ThreadPool(const unsigned workers);
+    ~ThreadPool();
+
+    // Calls task(0) .. task(count - 1), spread over the workers and the calling thread, and returns when all have finished
+    void run(const int count, const std::function<void(int)> & task);
+
+private:
+    struct Batch {
+        const std::function<void(int)> * task;
+        int count;
+        std::atomic<int> next;
+        int finished;
+    };
+
+    void work();
+
+    std::vector<std::thread> threads;
+    std::deque<Batch *> queue;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    bool stop;
+};
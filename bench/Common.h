@@ -0,0 +1,89 @@
+/*
+**   Benchmark and test support for VapourSynth-TCanny
+**
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Shared by the benchmark and the differential test. Both link TCanny.cpp without the plugin entry point, and set up a TCannyData through
+// initData, as tcannyCreate does, without a core.
+
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include "../TCanny/TCanny.h"
+
+struct Params {
+    int bits;
+    float sigma;
+    int op, nms, mode, opt, blur, fixed, plane;
+};
+
+// Sets d up for plane p.plane from the arguments of tcannyCreate, through the same initData; fixed is -1 for the default. Returns false for
+// combinations that tcannyCreate rejects.
+static bool setup(TCannyData * d, const VSVideoInfo * vi, const Params & p) {
+    d->vi = vi;
+    d->sigma = p.sigma;
+    d->t_h = 8.f;
+    d->t_l = 1.f;
+    d->gmmax = 50.f;
+    d->nms = p.nms;
+    d->modes[0] = p.mode;
+    d->outputs = 1;
+    d->op = p.op;
+    d->opt = p.opt;
+    d->blur = p.blur;
+    d->fixed = p.fixed == 1;
+    d->process[p.plane] = true;
+    d->threads = 1;
+    return !initData(d, 1, p.fixed == -1);
+}
+
+static bool parseList(const char * arg, std::vector<float> & values) {
+    values.clear();
+    char * end;
+    do {
+        values.push_back(strtof(arg, &end));
+        if (end == arg)
+            return false;
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+static bool parseList(const char * arg, std::vector<int> & values) {
+    std::vector<float> parsed;
+    if (!parseList(arg, parsed))
+        return false;
+    values.assign(parsed.begin(), parsed.end());
+    return true;
+}
+
+static bool parseSizes(const char * arg, std::vector<std::pair<int, int>> & sizes) {
+    sizes.clear();
+    char * end;
+    do {
+        const int width = strtol(arg, &end, 10);
+        if (*end != 'x')
+            return false;
+        const int height = strtol(end + 1, &end, 10);
+        if (width < 1 || height < 1)
+            return false;
+        sizes.emplace_back(width, height);
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
@@ -0,0 +1,308 @@
+/*
+**   In-memory VapourSynth core for the test of VapourSynth-TCanny
+**
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// The part of the VapourSynth API that the filter calls, over plain memory, so that the test can create instances with tcannyCreate and
+// run tcannyGetFrame without a core. Source clips are frames held in memory, and a request of a filter is answered straight from them.
+// As in the core, frames and nodes are reference counted, planes are shared between the frames that newVideoFrame2 builds from others,
+// and a filter is freed when the last reference to one of its outputs goes. getFrame may be called from several threads at once.
+
+#pragma once
+
+#include <map>
+#include <string>
+#include "Common.h"
+
+namespace MemoryCore {
+
+struct Value {
+    int64_t i;
+    double f;
+    std::shared_ptr<VSNode> node;
+    int output;
+};
+
+}
+
+struct VSMap {
+    std::map<std::string, std::vector<MemoryCore::Value>> values;
+    std::string error;
+};
+
+struct VSFrameRef {
+    const VSFormat * format;
+    int width[3], height[3], stride[3];
+    std::shared_ptr<uint8_t> planes[3];
+    VSMap props;
+    std::atomic<int> references;
+};
+
+// A source clip, or the outputs of a filter instance
+struct VSNode {
+    VSVideoInfo vi[4];
+    int outputs;
+    std::vector<const VSFrameRef *> frames;
+    VSFilterGetFrame getFrame;
+    VSFilterFree free;
+    void * instanceData;
+
+    ~VSNode();
+};
+
+struct VSNodeRef {
+    std::shared_ptr<VSNode> node;
+    int output;
+};
+
+struct VSFrameContext {
+    int output;
+    std::string error;
+};
+
+namespace MemoryCore {
+
+static const VSAPI * api();
+
+static VSFrameRef * VS_CC newVideoFrame2(const VSFormat * format, int width, int height, const VSFrameRef ** planeSrc, const int * planes,
+                                         const VSFrameRef * propSrc, VSCore * core) {
+    VSFrameRef * frame = new VSFrameRef();
+    frame->format = format;
+    frame->references = 1;
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        frame->width[plane] = plane ? width >> format->subSamplingW : width;
+        frame->height[plane] = plane ? height >> format->subSamplingH : height;
+        if (planeSrc && planeSrc[plane]) {
+            frame->stride[plane] = planeSrc[plane]->stride[planes[plane]];
+            frame->planes[plane] = planeSrc[plane]->planes[planes[plane]];
+        } else {
+            frame->stride[plane] = (frame->width[plane] * format->bytesPerSample + 63) & ~63;
+            frame->planes[plane] = std::shared_ptr<uint8_t>(vs_aligned_malloc<uint8_t>(static_cast<size_t>(frame->stride[plane]) * frame->height[plane], 64),
+                                                            [](uint8_t * p) { vs_aligned_free(p); });
+        }
+    }
+    if (propSrc)
+        frame->props = propSrc->props;
+    return frame;
+}
+
+static VSFrameRef * VS_CC newVideoFrame(const VSFormat * format, int width, int height, const VSFrameRef * propSrc, VSCore * core) {
+    return newVideoFrame2(format, width, height, nullptr, nullptr, propSrc, core);
+}
+
+static const VSFrameRef * VS_CC cloneFrameRef(const VSFrameRef * f) {
+    const_cast<VSFrameRef *>(f)->references++;
+    return f;
+}
+
+static void VS_CC freeFrame(const VSFrameRef * f) {
+    if (f && --const_cast<VSFrameRef *>(f)->references == 0)
+        delete f;
+}
+
+static int VS_CC getStride(const VSFrameRef * f, int plane) { return f->stride[plane]; }
+static const uint8_t * VS_CC getReadPtr(const VSFrameRef * f, int plane) { return f->planes[plane].get(); }
+static uint8_t * VS_CC getWritePtr(VSFrameRef * f, int plane) { return f->planes[plane].get(); }
+static const VSFormat * VS_CC getFrameFormat(const VSFrameRef * f) { return f->format; }
+static int VS_CC getFrameWidth(const VSFrameRef * f, int plane) { return f->width[plane]; }
+static int VS_CC getFrameHeight(const VSFrameRef * f, int plane) { return f->height[plane]; }
+static const VSMap * VS_CC getFramePropsRO(const VSFrameRef * f) { return &f->props; }
+static VSMap * VS_CC getFramePropsRW(VSFrameRef * f) { return &f->props; }
+
+static const VSVideoInfo * VS_CC getVideoInfo(VSNodeRef * node) { return &node->node->vi[node->output]; }
+static void VS_CC freeNode(VSNodeRef * node) { delete node; }
+
+static void VS_CC requestFrameFilter(int n, VSNodeRef * node, VSFrameContext * frameCtx) {}
+
+// Only source clips are ever requested; a clip shorter than n gives its last frame
+static const VSFrameRef * VS_CC getFrameFilter(int n, VSNodeRef * node, VSFrameContext * frameCtx) {
+    const std::vector<const VSFrameRef *> & frames = node->node->frames;
+    return cloneFrameRef(frames[std::min(n, static_cast<int>(frames.size()) - 1)]);
+}
+
+static int VS_CC getOutputIndex(VSFrameContext * frameCtx) { return frameCtx->output; }
+static void VS_CC setFilterError(const char * errorMessage, VSFrameContext * frameCtx) { frameCtx->error = errorMessage; }
+static void VS_CC setError(VSMap * map, const char * errorMessage) { map->error = errorMessage; }
+static void VS_CC logMessage(int msgType, const char * msg) {}
+
+static const VSCoreInfo * VS_CC getCoreInfo(VSCore * core) {
+    static const VSCoreInfo info = { "memory", 0, VAPOURSYNTH_API_VERSION, 4, 0, 0 };
+    return &info;
+}
+
+// Formats are unique like those of the core, so that they can be compared by pointer
+static const VSFormat * VS_CC registerFormat(int colorFamily, int sampleType, int bitsPerSample, int subSamplingW, int subSamplingH, VSCore * core) {
+    static std::mutex mutex;
+    static std::deque<VSFormat> formats;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (const VSFormat & format : formats) {
+        if (format.colorFamily == colorFamily && format.sampleType == sampleType && format.bitsPerSample == bitsPerSample &&
+            format.subSamplingW == subSamplingW && format.subSamplingH == subSamplingH)
+            return &format;
+    }
+    VSFormat format = {};
+    snprintf(format.name, sizeof(format.name), "%s%s%d", (colorFamily == cmGray) ? "Gray" : (colorFamily == cmRGB) ? "RGB" : "YUV",
+             (sampleType == stFloat) ? "F" : "P", bitsPerSample);
+    format.colorFamily = colorFamily;
+    format.sampleType = sampleType;
+    format.bitsPerSample = bitsPerSample;
+    format.bytesPerSample = (bitsPerSample + 7) / 8;
+    format.subSamplingW = subSamplingW;
+    format.subSamplingH = subSamplingH;
+    format.numPlanes = (colorFamily == cmGray) ? 1 : 3;
+    formats.push_back(format);
+    return &formats.back();
+}
+
+static const Value * find(const VSMap * map, const char * key, const int index, int * error) {
+    const auto it = map->values.find(key);
+    const int missing = (it == map->values.end()) ? 1 : (index >= static_cast<int>(it->second.size())) ? 4 : 0;
+    if (error)
+        *error = missing;
+    else if (missing)
+        abort(); // the core treats a missing required property as a fatal error
+    return missing ? nullptr : &it->second[index];
+}
+
+static int VS_CC propNumElements(const VSMap * map, const char * key) {
+    const auto it = map->values.find(key);
+    return (it == map->values.end()) ? -1 : static_cast<int>(it->second.size());
+}
+
+static int64_t VS_CC propGetInt(const VSMap * map, const char * key, int index, int * error) {
+    const Value * value = find(map, key, index, error);
+    return value ? value->i : 0;
+}
+
+static double VS_CC propGetFloat(const VSMap * map, const char * key, int index, int * error) {
+    const Value * value = find(map, key, index, error);
+    return value ? value->f : 0.;
+}
+
+static VSNodeRef * VS_CC propGetNode(const VSMap * map, const char * key, int index, int * error) {
+    const Value * value = find(map, key, index, error);
+    return value ? new VSNodeRef{ value->node, value->output } : nullptr;
+}
+
+static int VS_CC propSetInt(VSMap * map, const char * key, int64_t i, int append) {
+    std::vector<Value> & values = map->values[key];
+    if (append != paAppend)
+        values.clear();
+    values.push_back({ i, 0., nullptr, 0 });
+    return 0;
+}
+
+static int VS_CC propSetFloat(VSMap * map, const char * key, double d, int append) {
+    std::vector<Value> & values = map->values[key];
+    if (append != paAppend)
+        values.clear();
+    values.push_back({ 0, d, nullptr, 0 });
+    return 0;
+}
+
+static void VS_CC setVideoInfo(const VSVideoInfo * vi, int numOutputs, VSNode * node) {
+    std::copy(vi, vi + numOutputs, node->vi);
+    node->outputs = numOutputs;
+}
+
+// Puts one node per output of the filter into "clip" of out, as the core does
+static void VS_CC createFilter(const VSMap * in, VSMap * out, const char * name, VSFilterInit init, VSFilterGetFrame getFrame, VSFilterFree free,
+                               int filterMode, int flags, void * instanceData, VSCore * core) {
+    std::shared_ptr<VSNode> node = std::make_shared<VSNode>();
+    node->getFrame = getFrame;
+    node->free = free;
+    node->instanceData = instanceData;
+    init(const_cast<VSMap *>(in), out, &node->instanceData, node.get(), core, api());
+    for (int k = 0; k < node->outputs; k++)
+        out->values["clip"].push_back({ 0, 0., node, k });
+}
+
+static VSAPI makeApi() {
+    VSAPI vsapi = {};
+    vsapi.createFilter = createFilter;
+    vsapi.setError = setError;
+    vsapi.setFilterError = setFilterError;
+    vsapi.setVideoInfo = setVideoInfo;
+    vsapi.getCoreInfo = getCoreInfo;
+    vsapi.registerFormat = registerFormat;
+    vsapi.logMessage = logMessage;
+    vsapi.freeFrame = freeFrame;
+    vsapi.freeNode = freeNode;
+    vsapi.cloneFrameRef = cloneFrameRef;
+    vsapi.newVideoFrame = newVideoFrame;
+    vsapi.newVideoFrame2 = newVideoFrame2;
+    vsapi.getStride = getStride;
+    vsapi.getReadPtr = getReadPtr;
+    vsapi.getWritePtr = getWritePtr;
+    vsapi.getFrameFormat = getFrameFormat;
+    vsapi.getFrameWidth = getFrameWidth;
+    vsapi.getFrameHeight = getFrameHeight;
+    vsapi.getFramePropsRO = getFramePropsRO;
+    vsapi.getFramePropsRW = getFramePropsRW;
+    vsapi.getVideoInfo = getVideoInfo;
+    vsapi.requestFrameFilter = requestFrameFilter;
+    vsapi.getFrameFilter = getFrameFilter;
+    vsapi.getOutputIndex = getOutputIndex;
+    vsapi.propNumElements = propNumElements;
+    vsapi.propGetInt = propGetInt;
+    vsapi.propGetFloat = propGetFloat;
+    vsapi.propGetNode = propGetNode;
+    vsapi.propSetInt = propSetInt;
+    vsapi.propSetFloat = propSetFloat;
+    return vsapi;
+}
+
+static const VSAPI * api() {
+    static const VSAPI vsapi = makeApi();
+    return &vsapi;
+}
+
+// A source clip of the given frames, whose references it takes over
+static std::shared_ptr<VSNode> sourceClip(const VSFormat * format, const int width, const int height, const std::vector<VSFrameRef *> & frames) {
+    std::shared_ptr<VSNode> node = std::make_shared<VSNode>();
+    node->vi[0].format = format;
+    node->vi[0].width = width;
+    node->vi[0].height = height;
+    node->vi[0].fpsNum = 25;
+    node->vi[0].fpsDen = 1;
+    node->vi[0].numFrames = static_cast<int>(frames.size());
+    node->outputs = 1;
+    node->frames.assign(frames.begin(), frames.end());
+    return node;
+}
+
+// Frame n of an output of a filter, run the way the core schedules it: the initial call, and once the frames it asked for are there, the
+// call that computes it. The error of a failed frame is returned in `error`.
+static const VSFrameRef * getFrame(const VSNodeRef * ref, const int n, std::string & error) {
+    VSNode * node = ref->node.get();
+    VSFrameContext frameCtx = { ref->output, std::string() };
+    void * frameData = nullptr;
+    const VSFrameRef * frame = node->getFrame(n, arInitial, &node->instanceData, &frameData, &frameCtx, nullptr, api());
+    if (!frame && frameCtx.error.empty())
+        frame = node->getFrame(n, arAllFramesReady, &node->instanceData, &frameData, &frameCtx, nullptr, api());
+    error = frameCtx.error;
+    return frame;
+}
+
+}
+
+inline VSNode::~VSNode() {
+    if (free)
+        free(instanceData, nullptr, MemoryCore::api());
+    for (const VSFrameRef * frame : frames)
+        MemoryCore::freeFrame(frame);
+}
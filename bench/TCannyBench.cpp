@@ -0,0 +1,383 @@
+/*
+**   Stage benchmark for VapourSynth-TCanny
+**
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Times every stage of the filter on its own, on one plane at a time and on the calling thread only. Only the VapourSynth headers are
+// needed, never a core.
+
+#include <cctype>
+#include <chrono>
+#include "Common.h"
+
+enum BenchStage { stageConvV, stageConvH, stageIIR, stageGradient, stageSweep, stageHysteresis, stageOutput, stageCount };
+
+static const char * const stageNames[stageCount] = { "convV", "convH", "iir", "gradient", "sweep", "hysteresis", "output" };
+
+// A test image with samples in [0, 1], quantized to the benchmarked bit depth when its plane is built
+struct Frame {
+    std::string name;
+    int width, height;
+    std::vector<float> samples;
+};
+
+// Flat areas, a soft ramp, hard-edged shapes, a fine texture and a little noise, so that every stage sees both edges and background
+static Frame syntheticFrame(const int width, const int height) {
+    Frame frame;
+    frame.name = "synthetic";
+    frame.width = width;
+    frame.height = height;
+    frame.samples.resize(static_cast<size_t>(width) * height);
+
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float u = static_cast<float>(x) / width, v = static_cast<float>(y) / height;
+            float value = 0.2f + 0.3f * u;
+            if (std::abs(u - 0.3f) < 0.15f && std::abs(v - 0.4f) < 0.2f)
+                value = 0.8f;
+            if ((u - 0.7f) * (u - 0.7f) * width + (v - 0.6f) * (v - 0.6f) * height < 0.04f * std::min(width, height))
+                value = 0.1f;
+            if (v > 0.8f)
+                value += 0.1f * std::sin(x * 0.7f) * std::sin(y * 0.5f);
+            seed = seed * 1664525 + 1013904223;
+            value += ((seed >> 24) / 255.f - 0.5f) * (4.f / 255.f);
+            frame.samples[static_cast<size_t>(y) * width + x] = std::min(std::max(value, 0.f), 1.f);
+        }
+    }
+    return frame;
+}
+
+static int pgmToken(FILE * file) {
+    int c = fgetc(file);
+    while (c == '#' || std::isspace(c)) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF)
+                c = fgetc(file);
+        }
+        c = fgetc(file);
+    }
+    int value = 0;
+    while (c >= '0' && c <= '9') {
+        value = value * 10 + c - '0';
+        c = fgetc(file);
+    }
+    return value;
+}
+
+// Binary (P5) PGM with a maxval of up to 65535
+static bool loadPgm(const char * path, Frame & frame) {
+    FILE * file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    const bool magic = fgetc(file) == 'P' && fgetc(file) == '5';
+    const int width = magic ? pgmToken(file) : 0;
+    const int height = magic ? pgmToken(file) : 0;
+    const int maxval = magic ? pgmToken(file) : 0;
+    if (width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535) {
+        fclose(file);
+        return false;
+    }
+
+    const int bytes = maxval > 255 ? 2 : 1;
+    std::vector<uint8_t> raw(static_cast<size_t>(width) * height * bytes);
+    const bool complete = fread(raw.data(), 1, raw.size(), file) == raw.size();
+    fclose(file);
+    if (!complete)
+        return false;
+
+    frame.name = path;
+    frame.width = width;
+    frame.height = height;
+    frame.samples.resize(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < frame.samples.size(); i++) {
+        const int value = (bytes == 2) ? (raw[i * 2] << 8) | raw[i * 2 + 1] : raw[i];
+        frame.samples[i] = std::min(value, maxval) / static_cast<float>(maxval);
+    }
+    return true;
+}
+
+template<typename F>
+static void timeStage(double & best, F && stage) {
+    const auto start = std::chrono::steady_clock::now();
+    stage();
+    const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    best = std::min(best, elapsed);
+}
+
+// Runs the stages of one plane `iterations` times in the order getFrame does and keeps the fastest time of each.
+// bytes[] receives the plane traffic of every stage per pixel, counting each plane a pass reads or writes once.
+template<typename T, typename B>
+static void runPlane(const Frame & frame, const TCannyData * d, const int iterations, double best[stageCount], double bytes[stageCount]) {
+    const int width = frame.width, height = frame.height;
+    const int stride = ((width * static_cast<int>(sizeof(T)) + 63) & ~63) / static_cast<int>(sizeof(T));
+    const size_t pixels = static_cast<size_t>(stride) * height;
+    const double sample = sizeof(T), f = sizeof(float);
+
+    T * srcp = vs_aligned_malloc<T>(pixels * sizeof(T), 64);
+    T * dstp = vs_aligned_malloc<T>(pixels * sizeof(T), 64);
+    float * fa[3];
+    for (int i = 0; i < 3; i++)
+        fa[i] = vs_aligned_malloc<float>(pixels * sizeof(float), 64);
+    float * rows = vs_aligned_malloc<float>(static_cast<size_t>(stride) * 13 * sizeof(float), 64);
+    uint8_t * edges = vs_aligned_malloc<uint8_t>(pixels, 64);
+    T * direction = vs_aligned_malloc<T>(pixels * sizeof(T), 64);
+    Stack stack = {};
+    if (d->opt == 1 && d->wantEdges) {
+        stack.map = vs_aligned_malloc<uint8_t>(static_cast<size_t>(width) * height, 64);
+        stack.pos = vs_aligned_malloc<std::pair<int, int>>(static_cast<size_t>(width) * height * sizeof(std::pair<int, int>), 64);
+    }
+    std::vector<Run> runs;
+    std::vector<int> rowStart;
+    StageTimer timer(nullptr);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float value = frame.samples[static_cast<size_t>(y) * width + x];
+            if (std::is_integral<T>::value)
+                srcp[y * stride + x] = static_cast<T>(value * d->peak + 0.5f);
+            else
+                srcp[y * stride + x] = static_cast<T>(value);
+        }
+    }
+
+    for (int i = 0; i < stageCount; i++) {
+        best[i] = HUGE_VAL;
+        bytes[i] = 0.;
+    }
+    // The fused pipeline writes modes 1 and 3 from the sweep, and mode 2 reads the direction bins back besides the edge classes
+    const double planes = (d->modes[0] == 2) ? 2. : 1.;
+    if (d->opt == 1)
+        bytes[stageOutput] = planes * f + sample;
+    else
+        bytes[stageOutput] = (d->modes[0] == -1) ? f + sample : ((d->modes[0] == 2) ? 1. + 2. * sample : 1. + sample);
+
+    // The sweep writes the direction of mode 2 into a plane of its own, which the output stage then masks into dstp
+    SweepTargets targets = {};
+    float * blurred = (d->opt != 1 && d->blur == 2) ? fa[0] : nullptr;
+    targets.edges = d->wantEdges ? edges : nullptr;
+    targets.magnitude = d->wantMagnitude ? dstp : nullptr;
+    targets.direction = (d->modes[0] == 2) ? direction : (d->wantDirection ? dstp : nullptr);
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        if (d->opt == 1) {
+            // op=3 runs two separable passes in place of the blur; both are counted under convV
+            if (d->derivative) {
+                timeStage(best[stageConvV], [&] { derivativeImages<T>(srcp, fa[1], fa[0], fa[2], width, height, stride, 0.f, d, timer); });
+                bytes[stageConvV] = 2. * (sample + f) + 4. * f;
+            } else if (d->blur == 2) {
+                timeStage(best[stageIIR], [&] { iirBlur<T>(srcp, fa[0], width, height, stride, d->iir, 0.f); });
+                bytes[stageIIR] = sample + 3. * f;
+            } else {
+                timeStage(best[stageConvV], [&] { genConvV<T>(srcp, fa[1], width, height, stride, d->grad, d->weights, 0.f); });
+                timeStage(best[stageConvH], [&] { genConvH(fa[1], fa[0], width, height, stride, d->grad, d->weights); });
+                bytes[stageConvV] = sample + f;
+                bytes[stageConvH] = 2. * f;
+            }
+            if (!d->wantBlur) {
+                timeStage(best[stageGradient], [&] { d->gmDirImages(fa[0], fa[1], fa[2], width, height, stride, d, nullptr, nullptr, timer); });
+                bytes[stageGradient] = 3. * f;
+            }
+            if (d->wantEdges) {
+                timeStage(best[stageHysteresis], [&] { hystersis(fa[0], stack, width, height, stride, d->t_h, d->t_l, nullptr, nullptr, nullptr); });
+                bytes[stageHysteresis] = 2. * f;
+            }
+        } else {
+            if (blurred) {
+                timeStage(best[stageIIR], [&] { iirBlur<T>(srcp, blurred, width, height, stride, d->iir, 0.f); });
+                bytes[stageIIR] = sample + 3. * f;
+            }
+            // Mode -1 streams the kernel blur straight into the output, and with the recursive blur has nothing left to sweep
+            if (d->wantBlur && !blurred) {
+                timeStage(best[stageSweep], [&] { blurBand<T, B>(srcp, dstp, rows, width, height, stride, 0, height, 0, 0.f, d, timer); });
+                bytes[stageSweep] = 2. * sample;
+            } else if (!d->wantBlur) {
+                timeStage(best[stageSweep], [&] { d->sweep(srcp, targets, blurred, rows, width, height, stride, 0, height, 0, d, 0.f, timer); });
+                bytes[stageSweep] = (blurred ? f : sample) + (d->wantEdges ? 1. : 0.) + (d->wantMagnitude || d->wantDirection ? sample : 0.);
+            }
+            if (d->wantEdges) {
+                timeStage(best[stageHysteresis], [&] {
+                    hysteresisBands(edges, runs, rowStart, width, height, stride, d, nullptr, nullptr, nullptr);
+                });
+                bytes[stageHysteresis] = 2.;
+            }
+        }
+        if (d->opt == 1)
+            timeStage(best[stageOutput], [&] { outputRows<T>(fa, dstp, width, height, stride, 0, 0.f, d->modes[0], d); });
+        else if (d->modes[0] == 0 || d->modes[0] == 2 || (d->wantBlur && blurred))
+            timeStage(best[stageOutput], [&] { outputSweepRows<T>(targets, blurred, dstp, width, 0, height, stride, 0, 0.f, d->modes[0], d); });
+    }
+
+    vs_aligned_free(srcp);
+    vs_aligned_free(dstp);
+    for (int i = 0; i < 3; i++)
+        vs_aligned_free(fa[i]);
+    vs_aligned_free(rows);
+    vs_aligned_free(edges);
+    vs_aligned_free(direction);
+    vs_aligned_free(stack.map);
+    vs_aligned_free(stack.pos);
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: tcanny-bench [options]\n"
+            "  --size WxH,...     synthetic frame sizes [640x480,1920x1080]\n"
+            "  --pgm FILE         also run on a binary PGM image, may be repeated\n"
+            "  --bits N,...       8-16 for integer samples, 32 for float [8,16,32]\n"
+            "  --sigma S,...      [1.5]\n"
+            "  --op N,...         [1]\n"
+            "  --nms N,...        [3]\n"
+            "  --mode N,...       [0]\n"
+            "  --opt N,...        1-4 [every level the cpu supports]\n"
+            "  --blur N,...       0-2 [0]\n"
+            "  --fixed N,...      0 or 1, -1 picks it like the filter does [-1]\n"
+            "  --iterations N     runs per configuration, the fastest is reported [10]\n");
+}
+
+int main(int argc, char ** argv) {
+    const int maxOpt = detectOpt();
+    std::vector<std::pair<int, int>> sizes = { { 640, 480 }, { 1920, 1080 } };
+    std::vector<Frame> frames;
+    std::vector<int> bitsList = { 8, 16, 32 }, ops = { 1 }, nmsList = { 3 }, modes = { 0 }, opts, blurs = { 0 }, fixeds = { -1 };
+    std::vector<float> sigmas = { 1.5f };
+    int iterations = 10;
+    for (int opt = 1; opt <= maxOpt; opt++)
+        opts.push_back(opt);
+
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "-h" || option == "--help" || i + 1 == argc) {
+            usage();
+            return option == "-h" || option == "--help" ? 0 : 1;
+        }
+        const char * value = argv[++i];
+        bool ok = true;
+        if (option == "--size") {
+            ok = parseSizes(value, sizes);
+        } else if (option == "--pgm") {
+            frames.emplace_back();
+            ok = loadPgm(value, frames.back());
+            if (!ok) {
+                fprintf(stderr, "tcanny-bench: cannot read %s as a binary PGM\n", value);
+                return 1;
+            }
+        } else if (option == "--bits") {
+            ok = parseList(value, bitsList);
+        } else if (option == "--sigma") {
+            ok = parseList(value, sigmas);
+        } else if (option == "--op") {
+            ok = parseList(value, ops);
+        } else if (option == "--nms") {
+            ok = parseList(value, nmsList);
+        } else if (option == "--mode") {
+            ok = parseList(value, modes);
+        } else if (option == "--opt") {
+            ok = parseList(value, opts);
+        } else if (option == "--blur") {
+            ok = parseList(value, blurs);
+        } else if (option == "--fixed") {
+            ok = parseList(value, fixeds);
+        } else if (option == "--iterations") {
+            iterations = atoi(value);
+            ok = iterations > 0;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "tcanny-bench: invalid option %s %s\n", option.c_str(), value);
+            usage();
+            return 1;
+        }
+    }
+
+    for (const auto & size : sizes)
+        frames.push_back(syntheticFrame(size.first, size.second));
+
+    printf("%-24s %-10s %-7s %5s %2s %3s %4s %3s %4s %5s %-10s %9s %8s\n",
+           "frame", "size", "format", "sigma", "op", "nms", "mode", "opt", "blur", "fixed", "stage", "ns/pixel", "GB/s");
+
+    for (const auto & frame : frames) {
+        for (const int bits : bitsList) {
+            if ((bits < 8 || bits > 16) && bits != 32) {
+                fprintf(stderr, "tcanny-bench: skipping unsupported bit depth %d\n", bits);
+                continue;
+            }
+            VSFormat format = {};
+            format.colorFamily = cmGray;
+            format.sampleType = (bits == 32) ? stFloat : stInteger;
+            format.bitsPerSample = bits;
+            format.bytesPerSample = (bits == 32) ? 4 : (bits == 8) ? 1 : 2;
+            format.numPlanes = 1;
+            if (bits == 32)
+                snprintf(format.name, sizeof(format.name), "GrayS");
+            else
+                snprintf(format.name, sizeof(format.name), "Gray%d", bits);
+            VSVideoInfo vi = {};
+            vi.format = &format;
+            vi.width = frame.width;
+            vi.height = frame.height;
+
+            for (const float sigma : sigmas) for (const int op : ops) for (const int nms : nmsList) for (const int mode : modes)
+            for (const int opt : opts) for (const int blur : blurs) for (const int fixed : fixeds) {
+                // op has no effect on mode -1 and nms none on the odd modes, so those only run for the first value given
+                if ((mode == -1 && op != ops.front()) || ((mode & 1) && nms != nmsList.front()))
+                    continue;
+                if (opt < 1 || opt > maxOpt || sigma <= 0.f || op < 0 || op > 3 || nms < 0 || nms > 3 || mode < -1 || mode > 3 || blur < 0 || blur > 2)
+                    continue;
+
+                std::unique_ptr<TCannyData> d(new TCannyData());
+                const Params params = { bits, sigma, op, nms, mode, opt, blur, fixed, 0 };
+                if (!setup(d.get(), &vi, params)) {
+                    vs_aligned_free(d->weights);
+                    vs_aligned_free(d->weightsFixed);
+                    vs_aligned_free(d->derivative);
+                    continue;
+                }
+
+                double best[stageCount], bytes[stageCount];
+                if (bits == 32)
+                    runPlane<float, float>(frame, d.get(), iterations, best, bytes);
+                else if (bits == 8 && d->fixed)
+                    runPlane<uint8_t, int16_t>(frame, d.get(), iterations, best, bytes);
+                else if (bits == 8)
+                    runPlane<uint8_t, float>(frame, d.get(), iterations, best, bytes);
+                else if (d->fixed)
+                    runPlane<uint16_t, int16_t>(frame, d.get(), iterations, best, bytes);
+                else
+                    runPlane<uint16_t, float>(frame, d.get(), iterations, best, bytes);
+
+                const double pixels = static_cast<double>(frame.width) * frame.height;
+                char size[24];
+                snprintf(size, sizeof(size), "%dx%d", frame.width, frame.height);
+                for (int stage = 0; stage < stageCount; stage++) {
+                    if (best[stage] == HUGE_VAL)
+                        continue;
+                    printf("%-24s %-10s %-7s %5.2f %2d %3d %4d %3d %4d %5d %-10s %9.3f %8.2f\n",
+                           frame.name.c_str(), size, format.name, sigma, op, nms, mode, opt, d->blur, d->fixed ? 1 : 0, stageNames[stage],
+                           best[stage] / pixels, bytes[stage] * pixels / best[stage]);
+                }
+
+                vs_aligned_free(d->weights);
+                vs_aligned_free(d->weightsFixed);
+                vs_aligned_free(d->derivative);
+            }
+        }
+    }
+
+    return 0;
+}
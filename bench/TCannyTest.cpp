@@ -0,0 +1,1138 @@
+/*
+**   Differential test for VapourSynth-TCanny
+**
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Runs the optimized paths of every opt level against opt=1, the plain C reference that processes whole planes, on one plane at a time
+// and on the calling thread only. The planes are small and built to reach the edge cases of the kernels: odd sizes, planes narrower or
+// shorter than the blur radius, single rows and columns, subsampled chroma, flat areas and noise at full range. The fused sweep also
+// runs split into bands, which must not change its result. The whole filter then runs on frames held by MemoryCore.h.
+
+#include "MemoryCore.h"
+
+struct TestFormat {
+    const char * name;
+    int colorFamily, sampleType, bits, plane;
+};
+
+// The chroma planes of YUV are offset by half the range in float, and are half the size of the frame in both directions
+static const TestFormat testFormats[] = {
+    { "Gray8", cmGray, stInteger, 8, 0 },
+    { "Gray10", cmGray, stInteger, 10, 0 },
+    { "Gray12", cmGray, stInteger, 12, 0 },
+    { "Gray16", cmGray, stInteger, 16, 0 },
+    { "GrayH", cmGray, stFloat, 16, 0 },
+    { "GrayS", cmGray, stFloat, 32, 0 },
+    { "YUV420P8.U", cmYUV, stInteger, 8, 1 },
+    { "YUV420PH.U", cmYUV, stFloat, 16, 1 },
+    { "YUV420PS.U", cmYUV, stFloat, 32, 1 },
+};
+
+enum Pattern { patternShapes, patternNoise, patternFlat, patternCount };
+
+static const char * const patternNames[patternCount] = { "shapes", "noise", "flat" };
+
+// Samples in [0, 1]: hard-edged shapes over a ramp with a fine texture, uniform noise, or a constant that leaves no gradient at all
+static void fillPattern(std::vector<float> & samples, const int width, const int height, const Pattern pattern, uint32_t seed) {
+    samples.resize(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1664525 + 1013904223;
+            const float random = (seed >> 8) / 16777216.f;
+            float value = 0.5f;
+            if (pattern == patternShapes) {
+                const float u = (x + 0.5f) / width, v = (y + 0.5f) / height;
+                value = 0.2f + 0.3f * u;
+                if (std::abs(u - 0.4f) < 0.2f && std::abs(v - 0.4f) < 0.25f)
+                    value = 0.8f;
+                if (v > 0.7f)
+                    value += 0.1f * std::sin(x * 0.9f) * std::sin(y * 0.6f);
+                value += (random - 0.5f) * (4.f / 255.f);
+            } else if (pattern == patternNoise) {
+                value = random;
+            }
+            samples[static_cast<size_t>(y) * width + x] = std::min(std::max(value, 0.f), 1.f);
+        }
+    }
+}
+
+// One plane through the path that d->opt selects, in the order getFrame runs the stages; the fused sweep runs as `bands` bands
+template<typename T, typename B>
+static void runPath(const TCannyData * d, const T * srcp, T * dstp, const int width, const int height, const int stride, const int plane, const int bands) {
+    const float offset = (d->vi->format->sampleType == stInteger || plane == 0 || d->vi->format->colorFamily == cmRGB) ? 0.f : 0.5f;
+    const size_t pixels = static_cast<size_t>(stride) * height;
+
+    float * fa[3];
+    for (int i = 0; i < 3; i++)
+        fa[i] = vs_aligned_malloc<float>(pixels * sizeof(float), 64);
+    float * rows = vs_aligned_malloc<float>(static_cast<size_t>(stride) * 13 * sizeof(float), 64);
+    uint8_t * edges = vs_aligned_malloc<uint8_t>(pixels, 64);
+    T * direction = vs_aligned_malloc<T>(pixels * sizeof(T), 64);
+    Stack stack = {};
+    if (d->opt == 1 && d->wantEdges) {
+        stack.map = vs_aligned_malloc<uint8_t>(static_cast<size_t>(width) * height, 64);
+        stack.pos = vs_aligned_malloc<std::pair<int, int>>(static_cast<size_t>(width) * height * sizeof(std::pair<int, int>), 64);
+    }
+    std::vector<Run> runs;
+    std::vector<int> rowStart;
+    StageTimer timer(nullptr);
+
+    if (d->opt == 1) {
+        if (d->derivative) {
+            derivativeImages<T>(srcp, fa[1], fa[0], fa[2], width, height, stride, offset, d, timer);
+        } else if (d->blur == 2) {
+            iirBlur<T>(srcp, fa[0], width, height, stride, d->iir, offset);
+        } else {
+            genConvV<T>(srcp, fa[1], width, height, stride, d->grad, d->weights, offset);
+            genConvH(fa[1], fa[0], width, height, stride, d->grad, d->weights);
+        }
+        if (!d->wantBlur)
+            d->gmDirImages(fa[0], fa[1], fa[2], width, height, stride, d, nullptr, nullptr, timer);
+        if (d->wantEdges)
+            hystersis(fa[0], stack, width, height, stride, d->t_h, d->t_l, nullptr, nullptr, nullptr);
+        outputRows<T>(fa, dstp, width, height, stride, plane, offset, d->modes[0], d);
+    } else {
+        float * blurred = (d->blur == 2) ? fa[0] : nullptr;
+        if (blurred)
+            iirBlur<T>(srcp, blurred, width, height, stride, d->iir, offset);
+
+        SweepTargets targets = {};
+        targets.edges = d->wantEdges ? edges : nullptr;
+        targets.magnitude = d->wantMagnitude ? dstp : nullptr;
+        targets.direction = (d->modes[0] == 2) ? direction : (d->wantDirection ? dstp : nullptr);
+        for (int i = 0; i < bands; i++) {
+            const int y0 = height * i / bands, y1 = height * (i + 1) / bands;
+            if (d->wantBlur && !blurred)
+                blurBand<T, B>(srcp, dstp, rows, width, height, stride, y0, y1, plane, offset, d, timer);
+            else if (!d->wantBlur)
+                d->sweep(srcp, targets, blurred, rows, width, height, stride, y0, y1, plane, d, offset, timer);
+        }
+        if (d->wantEdges)
+            hysteresisBands(edges, runs, rowStart, width, height, stride, d, nullptr, nullptr, nullptr);
+        if (d->modes[0] == 0 || d->modes[0] == 2 || (d->wantBlur && blurred))
+            outputSweepRows<T>(targets, blurred, dstp, width, 0, height, stride, plane, offset, d->modes[0], d);
+    }
+
+    for (int i = 0; i < 3; i++)
+        vs_aligned_free(fa[i]);
+    vs_aligned_free(rows);
+    vs_aligned_free(edges);
+    vs_aligned_free(direction);
+    vs_aligned_free(stack.map);
+    vs_aligned_free(stack.pos);
+}
+
+// What a path may differ from the reference by: every sample by up to `step`, and a `share` of the samples by more. Directions are bins
+// of a half turn, so they are compared around a circle of `period`, and only where the gradient of the reference reaches `weak`, since
+// the direction of a gradient within rounding of zero is arbitrary.
+struct Tolerance {
+    double step, share, period, weak;
+};
+
+// How far an output of a path lies from the reference: the largest difference of a sample, in units of the least significant bit
+// for integer samples, and how many of the compared samples differ by more than the step of the tolerance
+struct Difference {
+    double largest;
+    size_t beyond, samples;
+};
+
+template<typename T>
+static Difference compare(const T * a, const T * b, const T * magnitude, const int width, const int height, const int stride, const Tolerance & allowed) {
+    Difference difference = {};
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (magnitude && static_cast<float>(magnitude[y * stride + x]) < allowed.weak)
+                continue;
+            double delta = std::abs(static_cast<double>(static_cast<float>(a[y * stride + x])) - static_cast<float>(b[y * stride + x]));
+            if (allowed.period)
+                delta = std::min(delta, allowed.period - delta);
+            difference.largest = std::max(difference.largest, delta);
+            difference.beyond += delta > allowed.step;
+            difference.samples++;
+        }
+    }
+    return difference;
+}
+
+// A share of a plane of fewer than smallPlane samples is a sample or two, so such planes may have at most smallPlaneBeyond samples
+// beyond the step where any share is allowed at all
+static const size_t smallPlane = 100;
+static const size_t smallPlaneBeyond = 2;
+
+static bool exceeds(const Difference & difference, const Tolerance & allowed) {
+    if (difference.samples < smallPlane)
+        return difference.beyond > (allowed.share ? smallPlaneBeyond : 0);
+    return difference.beyond > allowed.share * difference.samples;
+}
+
+// The fixed-point blur differs from the float one by a kernel applied to the samples: the product of the Q14 weights of its two passes less
+// that of the float weights. Over all planes its largest effect is the peak times the positive part of that kernel, plus the rounding of
+// the two int16 passes, which together stay within one unit of their 7 fractional bits at 8 bits. The gradient applies its 3x3 operator
+// to the same kernel and is a vector, so its error is bounded by the worst projection onto a direction, taken over a grid of directions
+// and widened by half the angle between them. Both are in 8-bit units; these are the figures the README gives for fixed.
+struct FixedError {
+    double blur, gradient;
+};
+
+static FixedError fixedError(const TCannyData * d) {
+    const int n = d->grad * 2 + 3;
+    const double rounding = 1. / 128.;
+    std::vector<double> kernel(static_cast<size_t>(n) * n);
+    double positive = 0.;
+    for (int i = 0; i < n - 2; i++) {
+        for (int j = 0; j < n - 2; j++) {
+            const double k = static_cast<double>(d->weightsFixed[i]) * d->weightsFixed[j] / (1 << (2 * fixedWeightBits)) - static_cast<double>(d->weights[i]) * d->weights[j];
+            kernel[(i + 1) * n + j + 1] = k;
+            positive += std::max(k, 0.);
+        }
+    }
+    FixedError error = { 255. * positive + rounding, 0. };
+
+    // Taps of the operator on the blurred plane, with the normalization of gradientRow
+    double gx[3][3] = {}, gy[3][3] = {};
+    for (int i = 0; i < 3; i++) {
+        const double tap = (d->op == 0) ? (i == 1) : (d->op == 1) ? 0.5 : (i == 1) ? 2. : 1.;
+        gx[i][2] = tap;
+        gx[i][0] = -tap;
+        gy[0][i] = tap;
+        gy[2][i] = -tap;
+    }
+    const int directions = 32;
+    for (int t = 0; t < directions; t++) {
+        const double cx = std::cos(M_PIF * t / directions), cy = std::sin(M_PIF * t / directions);
+        double sum = 0., taps = 0.;
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                double k = 0.;
+                for (int i = -1; i <= 1; i++) {
+                    for (int j = -1; j <= 1; j++) {
+                        if (y + i >= 0 && y + i < n && x + j >= 0 && x + j < n)
+                            k += (cx * gx[i + 1][j + 1] + cy * gy[i + 1][j + 1]) * kernel[(y + i) * n + x + j];
+                    }
+                }
+                sum += std::max(k, 0.);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                taps += std::abs(cx * gx[i][j] + cy * gy[i][j]);
+        }
+        error.gradient = std::max(error.gradient, 255. * sum + taps * rounding);
+    }
+    error.gradient /= std::cos(M_PIF / (2 * directions));
+    return error;
+}
+
+// The float blur and gradient of opt=2 run the same operations in the same order as opt=1, and the fused multiply-adds of opt=3 and 4
+// round differently, which moves samples by a step. In either, the sweep bins the direction of the suppression by comparing |dy| with
+// tan(pi/8)|dx| where opt=1 goes through atan2, so a gradient on a sector boundary or within rounding of t_h or t_l can flip an edge,
+// and the hysteresis the edges connected to it; only modes 0 and 2 may have a share of samples beyond the step. The fixed-point blur moves
+// the blurred samples and the magnitude by up to the bounds of fixedError, which flips more edges. A gradient vector that is off by
+// up to e turns by at most asin(e / |g|), so its directions are held to 1/32 of a half turn where the gradient of the reference is at
+// least e / sin(pi / 32).
+static Tolerance tolerance(const TCannyData * d, const int mode, const int plane) {
+    const bool integer = d->vi->format->sampleType == stInteger;
+    const bool edges = mode == 0 || mode == 2;
+    const double lsb = integer ? 1. : 1. / 1024.;
+    const double unit = integer ? 1 << (d->vi->format->bitsPerSample - 8) : 1. / 255.;
+    const FixedError error = d->fixed ? fixedError(d) : FixedError();
+
+    Tolerance allowed = {};
+    allowed.step = lsb;
+    if (mode == 2 || mode == 3) {
+        allowed.period = integer ? d->bins : 1.;
+        allowed.step = d->fixed ? allowed.period / 32. + lsb : std::max(lsb, allowed.period / 1024.);
+    }
+    allowed.weak = (integer ? 0. : d->lower[plane]) + (d->fixed ? error.gradient * d->magnitude * unit / std::sin(M_PIF / 32.) + lsb : allowed.step);
+
+    if (d->fixed) {
+        if (mode == -1)
+            allowed.step += error.blur * unit;
+        else if (mode == 1)
+            allowed.step += error.gradient * d->magnitude * unit;
+        allowed.share = edges ? 0.05 : 0.;
+    } else {
+        if (d->opt == 2)
+            allowed.step = 0.;
+        allowed.share = edges ? 0.01 : 0.;
+    }
+    return allowed;
+}
+
+struct Totals {
+    size_t comparisons, failures;
+};
+
+// The smallest plane on which the shapes are large enough to leave edges at every sigma tested by default
+static const int varyingPlane = 16;
+
+// Every optimized path of one plane and one set of parameters against the reference. F is the intermediate of the fixed-point blur,
+// which float samples do not have.
+template<typename T, typename F>
+static void testPlane(const TestFormat & format, const VSVideoInfo * vi, const std::vector<float> & samples, const int width, const int height,
+                      const Params & params, const std::vector<int> & opts, const Pattern pattern, const bool verbose, Totals & totals) {
+    const int stride = ((width * static_cast<int>(sizeof(T)) + 63) & ~63) / static_cast<int>(sizeof(T));
+    const size_t pixels = static_cast<size_t>(stride) * height;
+    std::vector<T> src(pixels), reference(pixels), result(pixels);
+
+    std::unique_ptr<TCannyData> d(new TCannyData());
+    Params p = params;
+    p.opt = 1;
+    p.fixed = 0;
+    if (!setup(d.get(), vi, p)) {
+        vs_aligned_free(d->weights);
+        vs_aligned_free(d->derivative);
+        return;
+    }
+
+    const float lower = (format.sampleType == stFloat) ? d->lower[format.plane] : 0.f;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float value = samples[static_cast<size_t>(y) * width + x];
+            src[y * stride + x] = static_cast<T>(std::is_integral<T>::value ? value * d->peak + 0.5f : value + lower);
+        }
+    }
+    runPath<T, float>(d.get(), src.data(), reference.data(), width, height, stride, format.plane, 1);
+    vs_aligned_free(d->weights);
+    vs_aligned_free(d->derivative);
+
+    // The shapes hold edges of half the range, so on a plane that has room for them every mode must give a reference that varies, except
+    // the edges of nms=0, which suppresses every pixel. A constant one means that the setup left nothing to compare, such as a plane
+    // without the range of its samples.
+    if (pattern == patternShapes && width >= varyingPlane && height >= varyingPlane && (params.nms || params.mode & 1)) {
+        bool constant = true;
+        for (int y = 0; y < height && constant; y++) {
+            for (int x = 0; x < width && constant; x++)
+                constant = static_cast<float>(reference[y * stride + x]) == static_cast<float>(reference[0]);
+        }
+        totals.comparisons++;
+        totals.failures += constant;
+        if (constant || verbose)
+            printf("%-4s %-10s %4dx%-4d %-6s sigma %.2f op %d nms %d mode %2d blur %d: reference %s\n", constant ? "FAIL" : "ok", format.name, width, height,
+                   patternNames[pattern], params.sigma, params.op, params.nms, params.mode, d->blur, constant ? "is constant" : "varies");
+    }
+
+    // The gradient magnitude of the reference, below which mode 3 directions are not compared
+    std::vector<T> magnitude;
+    if (params.mode == 3) {
+        std::unique_ptr<TCannyData> m(new TCannyData());
+        Params q = p;
+        q.mode = 1;
+        magnitude.resize(pixels);
+        if (setup(m.get(), vi, q))
+            runPath<T, float>(m.get(), src.data(), magnitude.data(), width, height, stride, format.plane, 1);
+        vs_aligned_free(m->weights);
+        vs_aligned_free(m->derivative);
+    }
+
+    for (const int opt : opts) {
+        for (int fixed = 0; fixed <= 1; fixed++) {
+            std::unique_ptr<TCannyData> o(new TCannyData());
+            p.opt = opt;
+            p.fixed = fixed;
+            if (!setup(o.get(), vi, p)) {
+                vs_aligned_free(o->weights);
+                vs_aligned_free(o->weightsFixed);
+                vs_aligned_free(o->derivative);
+                continue;
+            }
+
+            // Bands of the sweep recompute the rows around them, so splitting the plane must give the same result
+            for (int bands = 1; bands <= std::min(3, height); bands += 2) {
+                std::fill(result.begin(), result.end(), T());
+                if (o->fixed)
+                    runPath<T, F>(o.get(), src.data(), result.data(), width, height, stride, format.plane, bands);
+                else
+                    runPath<T, float>(o.get(), src.data(), result.data(), width, height, stride, format.plane, bands);
+
+                const Tolerance allowed = tolerance(o.get(), params.mode, format.plane);
+                const Difference difference = compare<T>(reference.data(), result.data(), magnitude.empty() ? nullptr : magnitude.data(), width, height, stride, allowed);
+                const bool failed = exceeds(difference, allowed);
+
+                totals.comparisons++;
+                totals.failures += failed;
+                if (failed || verbose)
+                    printf("%-4s %-10s %4dx%-4d %-6s sigma %.2f op %d nms %d mode %2d blur %d opt %d fixed %d bands %d: largest %g beyond %zu of %zu\n",
+                           failed ? "FAIL" : "ok", format.name, width, height, patternNames[pattern], params.sigma, params.op, params.nms, params.mode,
+                           o->blur, opt, o->fixed ? 1 : 0, bands, difference.largest, difference.beyond, difference.samples);
+            }
+
+            vs_aligned_free(o->weights);
+            vs_aligned_free(o->weightsFixed);
+            vs_aligned_free(o->derivative);
+        }
+    }
+}
+
+// testFilter: the whole filter, created by tcannyCreate on the in-memory core and run through tcannyGetFrame on frames of every plane at once. Each
+// opt level is held to the tolerance of the plane test against opt=1, and the paths that only the filter runs must give exactly the
+// samples of a simpler run that computes the same thing: threads, planes processed concurrently and the frames that the outputs of a
+// list of modes leave for each other must not change any sample; roi and mask must leave the selected samples of modes -1, 1 and 3 with
+// the kernel blur as they are in a whole frame, and fill the rest; mask8 must be mode 0 in 8 bits; and a cache hit must return the
+// frame that was computed for the same source. The last source frame repeats the first, for the cache.
+static const int filterWidth = 150, filterHeight = 100, filterFrames = 3;
+
+struct FilterArgs {
+    float sigma;
+    int op, blur, opt, fixed; // fixed -1 leaves it to the filter
+    std::vector<int> modes, roi;
+    bool mask, mask8;
+    int threads, scale, cache;
+    bool stats;
+};
+
+// The frames of every output of one instance, [frame][output]
+struct FilterRun {
+    std::shared_ptr<VSNode> node;
+    std::vector<std::vector<const VSFrameRef *>> frames;
+    std::string error;
+
+    FilterRun() = default;
+    FilterRun(const FilterRun &) = delete;
+    FilterRun & operator=(const FilterRun &) = delete;
+
+    ~FilterRun() {
+        for (const auto & outputs : frames) {
+            for (const VSFrameRef * frame : outputs)
+                MemoryCore::freeFrame(frame);
+        }
+    }
+
+    const TCannyData * data() const { return static_cast<const TCannyData *>(node->instanceData); }
+};
+
+// Fetches every frame of every output, either in order, or with one thread per output so that they ask for the same frames at once,
+// every other one walking the clip backwards
+static void runFilter(FilterRun & run, const std::shared_ptr<VSNode> & clip, const std::shared_ptr<VSNode> & mask, const FilterArgs & args,
+                      const bool concurrent) {
+    VSMap in, out;
+    in.values["clip"].push_back({ 0, 0., clip, 0 });
+    if (args.mask)
+        in.values["mask"].push_back({ 0, 0., mask, 0 });
+    MemoryCore::propSetFloat(&in, "sigma", args.sigma, paReplace);
+    MemoryCore::propSetInt(&in, "op", args.op, paReplace);
+    MemoryCore::propSetInt(&in, "blur", args.blur, paReplace);
+    MemoryCore::propSetInt(&in, "opt", args.opt, paReplace);
+    if (args.fixed >= 0)
+        MemoryCore::propSetInt(&in, "fixed", args.fixed, paReplace);
+    for (const int mode : args.modes)
+        MemoryCore::propSetInt(&in, "mode", mode, paAppend);
+    for (const int value : args.roi)
+        MemoryCore::propSetInt(&in, "roi", value, paAppend);
+    MemoryCore::propSetInt(&in, "mask8", args.mask8, paReplace);
+    MemoryCore::propSetInt(&in, "threads", args.threads, paReplace);
+    MemoryCore::propSetInt(&in, "scale", args.scale, paReplace);
+    MemoryCore::propSetInt(&in, "cache", args.cache, paReplace);
+    MemoryCore::propSetInt(&in, "debug", args.cache != 0, paReplace);
+    MemoryCore::propSetInt(&in, "stats", args.stats, paReplace);
+
+    tcannyCreate(&in, &out, nullptr, nullptr, MemoryCore::api());
+    if (!out.error.empty()) {
+        run.error = out.error;
+        return;
+    }
+    run.node = out.values["clip"][0].node;
+    const int outputs = run.node->outputs;
+    run.frames.assign(filterFrames, std::vector<const VSFrameRef *>(outputs, nullptr));
+
+    std::mutex mutex;
+    const auto fetch = [&](const int n, const int k) {
+        const VSNodeRef ref = { run.node, k };
+        std::string error;
+        run.frames[n][k] = MemoryCore::getFrame(&ref, n, error);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!run.frames[n][k] && run.error.empty())
+            run.error = error.empty() ? "no frame" : error;
+    };
+    if (concurrent) {
+        std::vector<std::thread> threads;
+        for (int k = 0; k < outputs; k++) {
+            threads.emplace_back([&, k]() {
+                for (int i = 0; i < filterFrames; i++)
+                    fetch((k & 1) ? filterFrames - 1 - i : i, k);
+            });
+        }
+        for (std::thread & thread : threads)
+            thread.join();
+    } else {
+        for (int n = 0; n < filterFrames; n++) {
+            for (int k = 0; k < outputs; k++)
+                fetch(n, k);
+        }
+    }
+}
+
+// What a sample holds where there is no edge and no gradient, as fillOutside writes it
+static void offValue(const TCannyData * d, const int plane, uint8_t value[4]) {
+    memset(value, 0, 4);
+    if (d->vi->format->sampleType == stFloat && d->vi->format->bitsPerSample == 16) {
+        const Half half = d->lower[plane];
+        memcpy(value, &half, sizeof(half));
+    } else if (d->vi->format->sampleType == stFloat) {
+        memcpy(value, &d->lower[plane], sizeof(float));
+    }
+}
+
+static bool sameFrame(const VSFrameRef * a, const VSFrameRef * b) {
+    if (a->format != b->format)
+        return false;
+    for (int plane = 0; plane < a->format->numPlanes; plane++) {
+        for (int y = 0; y < a->height[plane]; y++) {
+            if (memcmp(a->planes[plane].get() + y * a->stride[plane], b->planes[plane].get() + y * b->stride[plane], a->width[plane] * a->format->bytesPerSample))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Whether the processed planes of `result` are within the tolerance of `mode` of those of `reference`; `magnitude` is the mode 1 output
+// of the reference for mode 3
+template<typename T>
+static bool closeFrame(const VSFrameRef * reference, const VSFrameRef * result, const VSFrameRef * magnitude, const TCannyData * d, const int mode,
+                       Difference & worst) {
+    bool close = true;
+    for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+        const Tolerance allowed = tolerance(d, mode, plane);
+        const Difference difference = compare<T>(reinterpret_cast<const T *>(reference->planes[plane].get()), reinterpret_cast<const T *>(result->planes[plane].get()),
+                                                 magnitude ? reinterpret_cast<const T *>(magnitude->planes[plane].get()) : nullptr, reference->width[plane],
+                                                 reference->height[plane], reference->stride[plane] / static_cast<int>(sizeof(T)), allowed);
+        close &= !exceeds(difference, allowed);
+        if (difference.beyond * worst.samples >= worst.beyond * difference.samples)
+            worst = difference;
+    }
+    return close;
+}
+
+static bool closeFrame(const VSFrameRef * reference, const VSFrameRef * result, const VSFrameRef * magnitude, const TCannyData * d, const int mode,
+                       Difference & worst) {
+    const VSFormat * format = d->vi->format;
+    if (format->sampleType == stInteger && format->bitsPerSample == 8)
+        return closeFrame<uint8_t>(reference, result, magnitude, d, mode, worst);
+    else if (format->sampleType == stInteger)
+        return closeFrame<uint16_t>(reference, result, magnitude, d, mode, worst);
+    else if (format->bitsPerSample == 16)
+        return closeFrame<Half>(reference, result, magnitude, d, mode, worst);
+    return closeFrame<float>(reference, result, magnitude, d, mode, worst);
+}
+
+// Whether roi and the mask select a pixel of a plane. A pixel of a subsampled plane is in roi when its block of luma pixels reaches into
+// it, and in the mask when the luma pixel at its top left is.
+static bool isSelected(const int x, const int y, const int plane, const uint8_t * mask, const TCannyData * d) {
+    const int ssW = plane ? d->vi->format->subSamplingW : 0, ssH = plane ? d->vi->format->subSamplingH : 0;
+    const int lx = x << ssW, ly = y << ssH;
+    return lx + (1 << ssW) > d->roi[0] && lx < d->roi[2] && ly + (1 << ssH) > d->roi[1] && ly < d->roi[3] && (!mask || mask[ly * d->vi->width + lx]);
+}
+
+// The selected pixels of every plane, zero for the planes that are not processed
+static std::vector<double> countSelected(const TCannyData * d, const uint8_t * mask) {
+    const VSFormat * format = d->vi->format;
+    std::vector<double> counts(format->numPlanes, 0.);
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        const int width = plane ? d->vi->width >> format->subSamplingW : d->vi->width;
+        const int height = plane ? d->vi->height >> format->subSamplingH : d->vi->height;
+        for (int y = 0; y < height && d->process[plane]; y++) {
+            for (int x = 0; x < width; x++)
+                counts[plane] += isSelected(x, y, plane, mask, d);
+        }
+    }
+    return counts;
+}
+
+// Whether `region` holds the samples of `whole` at the pixels that roi and the mask select, and the value for no edge elsewhere
+static bool sameSelection(const VSFrameRef * whole, const VSFrameRef * region, const uint8_t * mask, const TCannyData * d) {
+    const VSFormat * format = d->vi->format;
+    const int bytes = format->bytesPerSample;
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+        uint8_t off[4];
+        offValue(d, plane, off);
+        for (int y = 0; y < whole->height[plane]; y++) {
+            for (int x = 0; x < whole->width[plane]; x++) {
+                const uint8_t * expected = isSelected(x, y, plane, mask, d) ? whole->planes[plane].get() + y * whole->stride[plane] + x * bytes : off;
+                if (memcmp(region->planes[plane].get() + y * region->stride[plane] + x * bytes, expected, bytes))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Whether the 8-bit mask of mask8 is 255 exactly where the mode 0 output of the same instance without mask8 has an edge, and 0 elsewhere
+// and in the planes that are not processed
+static bool sameMask(const VSFrameRef * edges, const VSFrameRef * mask, const TCannyData * d) {
+    const VSFormat * format = d->vi->format;
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        uint8_t off[4];
+        offValue(d, plane, off);
+        for (int y = 0; y < edges->height[plane]; y++) {
+            for (int x = 0; x < edges->width[plane]; x++) {
+                const bool edge = d->process[plane] && memcmp(edges->planes[plane].get() + y * edges->stride[plane] + x * format->bytesPerSample, off, format->bytesPerSample);
+                if (mask->planes[plane].get()[y * mask->stride[plane] + x] != (edge ? 255 : 0))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The edge pixels of a mode 0 output per plane, as TCannyEdgeCount gives them
+static std::vector<double> countEdges(const VSFrameRef * edges, const TCannyData * d) {
+    const VSFormat * format = d->vi->format;
+    std::vector<double> counts(format->numPlanes, 0.);
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        if (!d->process[plane])
+            continue;
+        uint8_t off[4];
+        offValue(d, plane, off);
+        for (int y = 0; y < edges->height[plane]; y++) {
+            for (int x = 0; x < edges->width[plane]; x++)
+                counts[plane] += memcmp(edges->planes[plane].get() + y * edges->stride[plane] + x * format->bytesPerSample, off, format->bytesPerSample) != 0;
+        }
+    }
+    return counts;
+}
+
+static std::vector<double> propValues(const VSFrameRef * frame, const char * key) {
+    std::vector<double> values;
+    const auto it = frame->props.values.find(key);
+    if (it != frame->props.values.end()) {
+        for (const MemoryCore::Value & value : it->second)
+            values.push_back(value.i + value.f);
+    }
+    return values;
+}
+
+// Source frames of the shapes pattern, a different seed per frame and plane but the first again for the last frame
+static std::shared_ptr<VSNode> filterClip(const VSFormat * format) {
+    std::vector<VSFrameRef *> frames;
+    std::vector<float> samples;
+    for (int n = 0; n < filterFrames; n++) {
+        VSFrameRef * frame = MemoryCore::newVideoFrame(format, filterWidth, filterHeight, nullptr, nullptr);
+        for (int plane = 0; plane < format->numPlanes; plane++) {
+            const int width = frame->width[plane], height = frame->height[plane];
+            const float lower = (format->sampleType == stFloat && plane && format->colorFamily == cmYUV) ? -0.5f : 0.f;
+            const int peak = (format->sampleType == stInteger) ? (1 << format->bitsPerSample) - 1 : 1;
+            fillPattern(samples, width, height, patternShapes, (n % (filterFrames - 1)) * 977 + plane * 131 + 7);
+            for (int y = 0; y < height; y++) {
+                uint8_t * row = frame->planes[plane].get() + y * frame->stride[plane];
+                for (int x = 0; x < width; x++) {
+                    const float value = samples[y * width + x];
+                    if (format->sampleType == stInteger && format->bytesPerSample == 1)
+                        row[x] = static_cast<uint8_t>(value * peak + 0.5f);
+                    else if (format->sampleType == stInteger)
+                        reinterpret_cast<uint16_t *>(row)[x] = static_cast<uint16_t>(value * peak + 0.5f);
+                    else if (format->bitsPerSample == 16)
+                        reinterpret_cast<Half *>(row)[x] = value + lower;
+                    else
+                        reinterpret_cast<float *>(row)[x] = value + lower;
+                }
+            }
+        }
+        frames.push_back(frame);
+    }
+    return MemoryCore::sourceClip(format, filterWidth, filterHeight, frames);
+}
+
+// A disc and a strip along the bottom, in a single frame that serves every frame of the clip
+static std::shared_ptr<VSNode> maskClip(std::vector<uint8_t> & selected) {
+    const VSFormat * format = MemoryCore::registerFormat(cmGray, stInteger, 8, 0, 0, nullptr);
+    VSFrameRef * frame = MemoryCore::newVideoFrame(format, filterWidth, filterHeight, nullptr, nullptr);
+    selected.resize(filterWidth * filterHeight);
+    for (int y = 0; y < filterHeight; y++) {
+        for (int x = 0; x < filterWidth; x++) {
+            const float dx = x - filterWidth * 0.4f, dy = y - filterHeight * 0.45f;
+            selected[y * filterWidth + x] = dx * dx + dy * dy < 30.f * 30.f || y >= filterHeight - 5;
+            frame->planes[0].get()[y * frame->stride[0] + x] = selected[y * filterWidth + x] ? 255 : 0;
+        }
+    }
+    return MemoryCore::sourceClip(format, filterWidth, filterHeight, { frame });
+}
+
+struct FilterFormat {
+    const char * name;
+    int colorFamily, sampleType, bits;
+};
+
+static const FilterFormat filterFormats[] = {
+    { "Gray8", cmGray, stInteger, 8 },
+    { "YUV420P10", cmYUV, stInteger, 10 },
+    { "YUV420PH", cmYUV, stFloat, 16 },
+    { "YUV420PS", cmYUV, stFloat, 32 },
+};
+
+// The kernel blur, the recursive blur of a large sigma, and the derivative of op=3
+static const FilterArgs filterConfigs[] = {
+    { 1.5f, 1, 0, 1, -1, {}, {}, false, false, 1, 1, 0, false },
+    { 6.f, 2, 0, 1, -1, {}, {}, false, false, 1, 1, 0, false },
+    { 1.5f, 3, 0, 1, -1, {}, {}, false, false, 1, 1, 0, false },
+};
+
+static void testFilter(const std::vector<int> & opts, const bool verbose, Totals & totals) {
+    static const int modes[] = { -1, 0, 1, 2, 3 };
+    const std::vector<int> list = { 0, 1, 2, 3 };
+    const std::vector<int> roi = { 17, 9, 90, 61 };
+    std::vector<uint8_t> selected;
+    const std::shared_ptr<VSNode> mask = maskClip(selected);
+
+    for (const FilterFormat & filterFormat : filterFormats) {
+        const VSFormat * format = MemoryCore::registerFormat(filterFormat.colorFamily, filterFormat.sampleType, filterFormat.bits, 1, 1, nullptr);
+        const std::shared_ptr<VSNode> clip = filterClip(format);
+
+        for (const FilterArgs & config : filterConfigs) {
+            char name[128];
+            const auto check = [&](const bool passed, const char * what, const int opt, const FilterRun & run, const int output) {
+                totals.comparisons++;
+                totals.failures += !passed;
+                if (!passed || verbose)
+                    printf("%-4s filter %-10s sigma %.2f op %d opt %d fixed %d: %s%s%s, output %d\n", passed ? "ok" : "FAIL", filterFormat.name, config.sigma,
+                           config.op, opt, run.node ? (run.data()->fixed ? 1 : 0) : -1, what, run.error.empty() ? "" : ": ", run.error.c_str(), output);
+            };
+
+            // The statistics count the edge pixels of mode 0, and with roi and mask only the selected pixels
+            const auto checkStats = [&](const FilterRun & run, const uint8_t * inside, const int opt) {
+                bool passed = run.error.empty();
+                for (int n = 0; n < filterFrames && passed; n++) {
+                    const std::vector<double> edges = propValues(run.frames[n][0], "TCannyEdgeCount");
+                    const std::vector<double> density = propValues(run.frames[n][0], "TCannyEdgeDensity");
+                    const std::vector<double> pixels = countSelected(run.data(), inside);
+                    passed = edges == countEdges(run.frames[n][0], run.data()) && density.size() == pixels.size();
+                    for (size_t plane = 0; plane < pixels.size() && passed; plane++)
+                        passed = !edges[plane] || std::lround(edges[plane] / density[plane]) == pixels[plane];
+                }
+                check(passed, "stats against the edges of mode 0 and the selected pixels", opt, run, 0);
+            };
+
+            // The reference of every mode, and of a list of them with roi, mask and scale
+            FilterRun reference[5], referenceRoi, referenceMask, referenceScale;
+            for (int i = 0; i < 5; i++) {
+                FilterArgs args = config;
+                args.modes = { modes[i] };
+                runFilter(reference[i], clip, mask, args, false);
+            }
+            FilterArgs args = config;
+            args.modes = list;
+            args.roi = roi;
+            args.stats = true;
+            runFilter(referenceRoi, clip, mask, args, false);
+            args.roi.clear();
+            args.mask = true;
+            runFilter(referenceMask, clip, mask, args, false);
+            args.mask = false;
+            args.stats = false;
+            args.scale = 2;
+            runFilter(referenceScale, clip, mask, args, false);
+            bool ready = referenceRoi.error.empty() && referenceMask.error.empty() && referenceScale.error.empty();
+            for (int i = 0; i < 5; i++)
+                ready &= reference[i].error.empty();
+            if (!ready) {
+                check(false, "opt=1 reference", 1, referenceScale, 0);
+                continue;
+            }
+            checkStats(referenceRoi, nullptr, 1);
+            checkStats(referenceMask, selected.data(), 1);
+
+            for (const int opt : opts) {
+                bool fixedAuto = false;
+                for (int fixed = -1; fixed <= 0; fixed++) {
+                    FilterArgs base = config;
+                    base.opt = opt;
+                    base.fixed = fixed;
+                    // Where the default does not take the fixed-point blur, fixed=0 is the same instance again
+                    if (fixed == 0 && !fixedAuto)
+                        break;
+                    FilterRun single[5];
+                    for (int i = 0; i < 5; i++) {
+                        FilterArgs args = base;
+                        args.modes = { modes[i] };
+                        runFilter(single[i], clip, mask, args, false);
+                    }
+
+                    for (int i = 0; i < 5; i++) {
+                        bool passed = single[i].error.empty();
+                        Difference worst = {};
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = closeFrame(reference[i].frames[n][0], single[i].frames[n][0], (modes[i] == 3) ? reference[3].frames[n][0] : nullptr,
+                                                single[i].data(), modes[i], worst);
+                        snprintf(name, sizeof(name), "mode %d against opt=1, largest %g beyond %zu of %zu", modes[i], worst.largest, worst.beyond, worst.samples);
+                        check(passed, name, opt, single[i], 0);
+                    }
+                    if (!single[1].error.empty())
+                        continue;
+                    fixedAuto = single[1].data()->fixed;
+                    const bool kernelBlur = single[1].data()->blur == 1 && single[0].data()->blur == 1;
+
+                    FilterRun serial, threaded, blurThreaded, region, regionBlur, masked, maskedBlur, scaled, mask8, cached, cachedThreaded;
+                    FilterArgs args = base;
+                    args.modes = list;
+                    runFilter(serial, clip, mask, args, false);
+                    args.threads = 4;
+                    runFilter(threaded, clip, mask, args, true);
+                    args.stats = true;
+                    args.roi = roi;
+                    runFilter(region, clip, mask, args, true);
+                    args.roi.clear();
+                    args.mask = true;
+                    runFilter(masked, clip, mask, args, true);
+                    args.mask = false;
+                    args.stats = false;
+                    args.scale = 2;
+                    runFilter(scaled, clip, mask, args, true);
+                    args.scale = 1;
+                    args.modes = { 0, 1 };
+                    args.mask8 = true;
+                    runFilter(mask8, clip, mask, args, true);
+                    args.mask8 = false;
+                    args.cache = 2;
+                    args.stats = true;
+                    runFilter(cached, clip, mask, args, false);
+                    runFilter(cachedThreaded, clip, mask, args, true);
+                    args = base;
+                    args.modes = { -1 };
+                    args.threads = 4;
+                    runFilter(blurThreaded, clip, mask, args, true);
+                    args.roi = roi;
+                    runFilter(regionBlur, clip, mask, args, true);
+                    args.roi.clear();
+                    args.mask = true;
+                    runFilter(maskedBlur, clip, mask, args, true);
+
+                    for (int k = 0; k < 4; k++) {
+                        const int i = k + 1;
+                        bool passed = serial.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = sameFrame(single[i].frames[n][0], serial.frames[n][k]);
+                        check(passed, "a list of modes against each mode alone", opt, serial, k);
+
+                        passed = threaded.error.empty() && serial.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = sameFrame(serial.frames[n][k], threaded.frames[n][k]);
+                        check(passed, "threads=4 with concurrent requests against threads=1", opt, threaded, k);
+
+                        Difference worst = {};
+                        passed = region.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = closeFrame(referenceRoi.frames[n][k], region.frames[n][k], (k == 3) ? referenceRoi.frames[n][1] : nullptr, single[i].data(), k, worst);
+                        check(passed, "roi against opt=1", opt, region, k);
+                        passed = masked.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = closeFrame(referenceMask.frames[n][k], masked.frames[n][k], (k == 3) ? referenceMask.frames[n][1] : nullptr, single[i].data(), k, worst);
+                        check(passed, "mask against opt=1", opt, masked, k);
+                        passed = scaled.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = closeFrame(referenceScale.frames[n][k], scaled.frames[n][k], (k == 3) ? referenceScale.frames[n][1] : nullptr, scaled.data(), k, worst);
+                        check(passed, "scale=2 against opt=1", opt, scaled, k);
+
+                        if (kernelBlur && (k == 1 || k == 3)) {
+                            passed = region.error.empty() && masked.error.empty();
+                            for (int n = 0; n < filterFrames && passed; n++)
+                                passed = sameSelection(serial.frames[n][k], region.frames[n][k], nullptr, region.data()) &&
+                                         sameSelection(serial.frames[n][k], masked.frames[n][k], selected.data(), masked.data());
+                            check(passed, "roi and mask against the whole frame", opt, region, k);
+                        }
+
+                    }
+
+                    // The last frame repeats the first, so it is a hit and carries the statistics of the first. No frame is kept for an
+                    // output that has not asked for one yet, so output 1 also takes the first frame from the cache; the others it takes
+                    // from the frames that output 0 computed.
+                    bool passed = cached.error.empty();
+                    for (int k = 0; k < 2 && passed; k++) {
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = sameFrame(single[k + 1].frames[n][0], cached.frames[n][k]) &&
+                                     propValues(cached.frames[n][k], "TCannyCacheHit") == std::vector<double>(1, n == filterFrames - 1 || (k && !n));
+                        passed = passed && propValues(cached.frames[filterFrames - 1][k], "TCannyEdgeCount") == propValues(cached.frames[0][k], "TCannyEdgeCount") &&
+                                 propValues(cached.frames[filterFrames - 1][k], "TCannyGradientMean") == propValues(cached.frames[0][k], "TCannyGradientMean");
+                    }
+                    check(passed, "cache against no cache", opt, cached, 0);
+                    // Frames requested one at a time share a single working set, and there are never more bands in progress than threads
+                    passed = cached.error.empty() && cached.data()->scratch.size() == 1 && cached.data()->rows.size() <= static_cast<size_t>(cached.data()->threads);
+                    for (int n = 0; n < filterFrames - 1 && passed; n++) {
+                        const std::vector<double> bytes = propValues(cached.frames[n][0], "TCannyScratchBytes");
+                        passed = bytes.size() == 1 && bytes[0] > 0. && bytes[0] <= cached.data()->scratchBytes &&
+                                 (!n || bytes[0] >= propValues(cached.frames[n - 1][0], "TCannyScratchBytes")[0]);
+                    }
+                    check(passed, "scratch memory reused between frames", opt, cached, 0);
+
+                    passed = cachedThreaded.error.empty();
+                    for (int k = 0; k < 2 && passed; k++) {
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = sameFrame(single[k + 1].frames[n][0], cachedThreaded.frames[n][k]);
+                    }
+                    check(passed, "cache with concurrent requests against no cache", opt, cachedThreaded, 0);
+
+                    checkStats(cached, nullptr, opt);
+                    checkStats(region, nullptr, opt);
+                    checkStats(masked, selected.data(), opt);
+
+                    // Once every output has had every frame, no frame may be left waiting for one, whether the outputs asked in turn or
+                    // all at once: a frame is kept only for the outputs that have not had it, however many of them computed it
+                    for (const FilterRun * run : { &serial, &threaded }) {
+                        passed = run->error.empty();
+                        for (const PendingFrame & entry : run->data()->pending) {
+                            for (int k = 0; k < run->data()->outputs; k++)
+                                passed &= !entry.frame[k] && !entry.computing;
+                        }
+                        check(passed, "no frame left pending", opt, *run, 0);
+                    }
+
+                    passed = blurThreaded.error.empty();
+                    for (int n = 0; n < filterFrames && passed; n++)
+                        passed = sameFrame(single[0].frames[n][0], blurThreaded.frames[n][0]);
+                    check(passed, "mode -1 with threads=4 against threads=1", opt, blurThreaded, 0);
+                    if (kernelBlur) {
+                        passed = regionBlur.error.empty() && maskedBlur.error.empty();
+                        for (int n = 0; n < filterFrames && passed; n++)
+                            passed = sameSelection(single[0].frames[n][0], regionBlur.frames[n][0], nullptr, regionBlur.data()) &&
+                                     sameSelection(single[0].frames[n][0], maskedBlur.frames[n][0], selected.data(), maskedBlur.data());
+                        check(passed, "mode -1 with roi and mask against the whole frame", opt, regionBlur, 0);
+                    }
+
+                    passed = mask8.error.empty();
+                    for (int n = 0; n < filterFrames && passed; n++)
+                        passed = sameMask(single[1].frames[n][0], mask8.frames[n][0], mask8.data()) && sameFrame(single[2].frames[n][0], mask8.frames[n][1]);
+                    check(passed, "mask8 against mode 0", opt, mask8, 0);
+                }
+            }
+        }
+    }
+}
+
+// The frames kept for the outputs of a list of modes, driven directly: a request for a frame that another output is computing computes
+// it again, one for a frame already computed takes its frame, and no frame is kept twice, for an output that has not asked for any, or
+// for one that has already had that frame, computed or from the cache.
+static void testPending(const bool verbose, Totals & totals) {
+    const auto check = [&](const bool passed, const char * what) {
+        totals.comparisons++;
+        totals.failures += !passed;
+        if (!passed || verbose)
+            printf("%-4s pending frames: %s\n", passed ? "ok" : "FAIL", what);
+    };
+    const VSAPI * vsapi = MemoryCore::api();
+    const VSFormat * format = MemoryCore::registerFormat(cmGray, stInteger, 8, 0, 0, nullptr);
+    const auto frames = [&](VSFrameRef ** dst) {
+        for (int k = 0; k < 3; k++)
+            dst[k] = MemoryCore::newVideoFrame(format, 8, 8, nullptr, nullptr);
+    };
+
+    TCannyData d = {};
+    d.outputs = 3;
+    d.pendingLimit = 4;
+
+    // Outputs 0 and 1 both compute frame 0, and output 1 finishes first; output 2 has not asked for any frame
+    VSFrameRef * dst[3], * again[3];
+    frames(dst);
+    frames(again);
+    takePending(&d, 0, 0, false);
+    takePending(&d, 0, 0, true);
+    takePending(&d, 0, 1, false);
+    check(!takePending(&d, 0, 1, true), "a frame being computed is computed again");
+    putPending(&d, 0, again, 1, true, vsapi);
+    putPending(&d, 0, dst, 0, true, vsapi);
+    check(d.pending.size() == 1 && !d.pending.front().frame[0] && !d.pending.front().frame[1], "no duplicate kept for either output");
+    check(!d.pending.front().frame[2], "no frame kept for an output that has not asked for any");
+    check(!d.pending.front().computing, "no computation left on the frame");
+    vsapi->freeFrame(dst[0]);
+    vsapi->freeFrame(again[1]);
+
+    // Output 1 asks for frame 1 while output 0 computes it, and takes the result once it is there
+    frames(dst);
+    takePending(&d, 1, 0, true);
+    takePending(&d, 1, 1, false);
+    putPending(&d, 1, dst, 0, true, vsapi);
+    VSFrameRef * taken = takePending(&d, 1, 1, true);
+    check(taken == dst[1], "a frame already computed is handed over");
+    vsapi->freeFrame(dst[0]);
+    vsapi->freeFrame(taken);
+
+    // Output 0 asks for frame 1 again after output 1 has had it, and takes frame 2 from the cache before output 1 computes it
+    frames(dst);
+    takePending(&d, 1, 0, true);
+    putPending(&d, 1, dst, 0, true, vsapi);
+    vsapi->freeFrame(dst[0]);
+    check(!findPending(&d, 1)->frame[1], "no frame kept for an output that has already had it");
+
+    takePending(&d, 2, 0, true);
+    putPending(&d, 2, nullptr, 0, true, vsapi);
+    frames(dst);
+    takePending(&d, 2, 1, true);
+    putPending(&d, 2, dst, 1, true, vsapi);
+    vsapi->freeFrame(dst[1]);
+    check(!findPending(&d, 2)->frame[0], "no frame kept for an output that had it from the cache");
+
+    for (int n = 3; n < 8; n++) {
+        frames(dst);
+        takePending(&d, n, 0, true);
+        putPending(&d, n, dst, 0, true, vsapi);
+        vsapi->freeFrame(dst[0]);
+    }
+    check(d.pending.size() == d.pendingLimit && d.pending.front().n == 4, "the oldest frames dropped beyond pendingLimit");
+    for (PendingFrame & entry : d.pending) {
+        for (int k = 0; k < d.outputs; k++)
+            vsapi->freeFrame(entry.frame[k]);
+    }
+}
+
+// The result cache driven directly: a source that two threads both missed and then cached is kept once, and a hit moves its entry to
+// the front.
+static void testCache(const bool verbose, Totals & totals) {
+    const auto check = [&](const bool passed, const char * what) {
+        totals.comparisons++;
+        totals.failures += !passed;
+        if (!passed || verbose)
+            printf("%-4s result cache: %s\n", passed ? "ok" : "FAIL", what);
+    };
+    const VSAPI * vsapi = MemoryCore::api();
+    VSVideoInfo vi = {};
+    vi.format = MemoryCore::registerFormat(cmGray, stInteger, 8, 0, 0, nullptr);
+    vi.width = 8;
+    vi.height = 8;
+    const auto frame = [&](const int value) {
+        VSFrameRef * f = vsapi->newVideoFrame(vi.format, vi.width, vi.height, nullptr, nullptr);
+        memset(vsapi->getWritePtr(f, 0), value, vsapi->getStride(f, 0) * vi.height);
+        return f;
+    };
+
+    TCannyData d = {};
+    d.vi = &vi;
+    d.process[0] = true;
+    d.outputs = 1;
+    d.cacheSize = 2;
+
+    VSFrameRef * src[] = { frame(1), frame(2), frame(1) };
+    VSFrameRef * dst[] = { frame(0), frame(0), frame(0) };
+    const uint64_t hash[] = { hashFrame(src[0], &d, vsapi), hashFrame(src[1], &d, vsapi), hashFrame(src[2], &d, vsapi) };
+    for (int i = 0; i < 3; i++)
+        putCache(&d, hash[i], src[i], &dst[i], vsapi);
+    check(d.cache.size() == 2 && d.cache.front().dst[0] == dst[0] && d.cache.back().dst[0] == dst[1], "a source cached twice kept once");
+
+    const VSFrameRef * hit = lookupCache(&d, hash[1], src[1], 0, vsapi);
+    check(hit == dst[1] && d.cache.front().dst[0] == dst[1], "a hit moved to the front");
+    vsapi->freeFrame(hit);
+
+    for (CacheEntry & entry : d.cache) {
+        vsapi->freeFrame(entry.src);
+        vsapi->freeFrame(entry.dst[0]);
+    }
+    for (int i = 0; i < 3; i++) {
+        vsapi->freeFrame(src[i]);
+        vsapi->freeFrame(dst[i]);
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: tcanny-test [options]\n"
+            "  --size WxH,...     frame sizes, of which chroma planes get half [1x1,2x2,9x1,1x9,3x7,5x3,17x13,67x45,130x21]\n"
+            "  --opt N,...        optimized levels 2-4 tested against opt=1 [every level the cpu supports]\n"
+            "  --sigma S,...      [0.5,1.5,4]\n"
+            "  --seed N           seed of the noise [1]\n"
+            "  --verbose N        1 also lists the comparisons that pass [0]\n");
+}
+
+int main(int argc, char ** argv) {
+    const int maxOpt = detectOpt();
+    std::vector<std::pair<int, int>> sizes = { { 1, 1 }, { 2, 2 }, { 9, 1 }, { 1, 9 }, { 3, 7 }, { 5, 3 }, { 17, 13 }, { 67, 45 }, { 130, 21 } };
+    std::vector<int> opts, seeds = { 1 }, verbose = { 0 };
+    std::vector<float> sigmas = { 0.5f, 1.5f, 4.f };
+    for (int opt = 2; opt <= maxOpt; opt++)
+        opts.push_back(opt);
+
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "-h" || option == "--help" || i + 1 == argc) {
+            usage();
+            return option == "-h" || option == "--help" ? 0 : 1;
+        }
+        const char * value = argv[++i];
+        bool ok = true;
+        if (option == "--size")
+            ok = parseSizes(value, sizes);
+        else if (option == "--opt")
+            ok = parseList(value, opts);
+        else if (option == "--sigma")
+            ok = parseList(value, sigmas);
+        else if (option == "--seed")
+            ok = parseList(value, seeds) && seeds.size() == 1;
+        else if (option == "--verbose")
+            ok = parseList(value, verbose) && verbose.size() == 1;
+        else
+            ok = false;
+        for (const int opt : opts)
+            ok &= opt >= 2 && opt <= 4;
+        if (!ok) {
+            fprintf(stderr, "tcanny-test: invalid option %s %s\n", option.c_str(), value);
+            usage();
+            return 1;
+        }
+    }
+    opts.erase(std::remove_if(opts.begin(), opts.end(), [&](const int opt) {
+        if (opt > maxOpt)
+            fprintf(stderr, "tcanny-test: skipping opt=%d, which this cpu does not support\n", opt);
+        return opt > maxOpt;
+    }), opts.end());
+
+    Totals totals = {};
+    std::vector<float> samples;
+    for (const TestFormat & format : testFormats) {
+        VSFormat vsFormat = {};
+        vsFormat.colorFamily = format.colorFamily;
+        vsFormat.sampleType = format.sampleType;
+        vsFormat.bitsPerSample = format.bits;
+        vsFormat.bytesPerSample = (format.bits == 8) ? 1 : (format.bits == 32) ? 4 : 2;
+        vsFormat.subSamplingW = vsFormat.subSamplingH = format.plane ? 1 : 0;
+        vsFormat.numPlanes = (format.colorFamily == cmGray) ? 1 : 3;
+
+        for (const auto & size : sizes) {
+            const int width = size.first >> vsFormat.subSamplingW, height = size.second >> vsFormat.subSamplingH;
+            if (width < 1 || height < 1)
+                continue;
+            VSVideoInfo vi = {};
+            vi.format = &vsFormat;
+            vi.width = size.first;
+            vi.height = size.second;
+
+            for (int pattern = 0; pattern < patternCount; pattern++) {
+                fillPattern(samples, width, height, static_cast<Pattern>(pattern), seeds[0] * 2654435761u + width * 31 + height);
+
+                for (const float sigma : sigmas) for (int op = 0; op <= 3; op++) for (int nms = 0; nms <= 3; nms++)
+                for (int mode = -1; mode <= 3; mode++) for (int blur = 1; blur <= 2; blur++) {
+                    // op has no effect on mode -1 and nms none on the odd modes
+                    if ((mode == -1 && op != 0) || ((mode & 1) && nms != 3))
+                        continue;
+                    const Params params = { format.bits, sigma, op, nms, mode, 1, blur, 0, format.plane };
+                    if (format.sampleType == stInteger && format.bits == 8)
+                        testPlane<uint8_t, int16_t>(format, &vi, samples, width, height, params, opts, static_cast<Pattern>(pattern), verbose[0] != 0, totals);
+                    else if (format.sampleType == stInteger)
+                        testPlane<uint16_t, int16_t>(format, &vi, samples, width, height, params, opts, static_cast<Pattern>(pattern), verbose[0] != 0, totals);
+                    else if (format.bits == 16)
+                        testPlane<Half, float>(format, &vi, samples, width, height, params, opts, static_cast<Pattern>(pattern), verbose[0] != 0, totals);
+                    else
+                        testPlane<float, float>(format, &vi, samples, width, height, params, opts, static_cast<Pattern>(pattern), verbose[0] != 0, totals);
+                }
+            }
+        }
+    }
+
+    testFilter(opts, verbose[0] != 0, totals);
+    testPending(verbose[0] != 0, totals);
+    testCache(verbose[0] != 0, totals);
+
+    printf("%zu comparisons, %zu failed\n", totals.comparisons, totals.failures);
+    return totals.failures ? 1 : 0;
+}